@@ -28,6 +28,7 @@
 #include <linux/err.h>
 #include <linux/clk.h>
 #include <linux/reboot.h>
+#include <linux/sched.h>
 
 #include <mach/gpio.h>
 #include <mach/sram.h>
@@ -599,6 +600,10 @@ static int omap3_pm_suspend(void)
 {
 	struct power_state *pwrst;
 	int state, ret = 0;
+	u64 t_enter, t_sleep, t_wake;
+
+	/* Failing before omap_sram_idle() charges everything to the exit */
+	t_enter = t_sleep = t_wake = sched_clock();
 
 	if (wakeup_timer_seconds)
 		omap2_pm_wakeup_on_timer(wakeup_timer_seconds);
@@ -617,7 +622,9 @@ static int omap3_pm_suspend(void)
 	omap_uart_prepare_suspend();
 
 	regset_save_on_suspend = 1;
+	t_sleep = sched_clock();
 	omap_sram_idle();
+	t_wake = sched_clock();
 	regset_save_on_suspend = 0;
 
 restore:
@@ -638,6 +645,7 @@ restore:
 		printk(KERN_INFO "Successfully put all powerdomains "
 		       "to target state\n");
 
+	device_pm_profile_platform(t_sleep - t_enter, sched_clock() - t_wake);
 	return ret;
 }
 
@@ -23,6 +23,7 @@
 #include <linux/pm.h>
 #include <linux/resume-trace.h>
 #include <linux/rwsem.h>
+#include <linux/sched.h>
 #include <linux/timer.h>
 
 #include "../base.h"
@@ -317,10 +318,13 @@ static void dpm_power_up(pm_message_t state)
 
 	list_for_each_entry(dev, &dpm_list, power.entry)
 		if (dev->power.status > DPM_OFF) {
+			u64 start = sched_clock();
 			int error;
 
 			dev->power.status = DPM_OFF;
 			error = resume_device_noirq(dev, state);
+			dpm_profile_device(dev, DPM_PHASE_RESUME_EARLY, start,
+					   error);
 			if (error)
 				pm_dev_err(dev, state, " early", error);
 		}
@@ -453,12 +457,15 @@ static void dpm_resume(pm_message_t state)
 
 		get_device(dev);
 		if (dev->power.status >= DPM_OFF) {
+			u64 start;
 			int error;
 
 			dev->power.status = DPM_RESUMING;
 			mutex_unlock(&dpm_list_mtx);
 
+			start = sched_clock();
 			error = resume_device(dev, state);
+			dpm_profile_device(dev, DPM_PHASE_RESUME, start, error);
 
 			mutex_lock(&dpm_list_mtx);
 			if (error)
@@ -547,6 +554,7 @@ void device_resume(pm_message_t state)
 	might_sleep();
 	dpm_resume(state);
 	dpm_complete(state);
+	device_pm_profile_exit(DPM_POINT_DEVICES);
 }
 EXPORT_SYMBOL_GPL(device_resume);
 
@@ -612,7 +620,10 @@ int device_power_down(pm_message_t state)
 	int error = 0;
 
 	list_for_each_entry_reverse(dev, &dpm_list, power.entry) {
+		u64 start = sched_clock();
+
 		error = suspend_device_noirq(dev, state);
+		dpm_profile_device(dev, DPM_PHASE_SUSPEND_LATE, start, error);
 		if (error) {
 			pm_dev_err(dev, state, " late", error);
 			break;
@@ -693,12 +704,15 @@ static int dpm_suspend(pm_message_t state)
 	mutex_lock(&dpm_list_mtx);
 	while (!list_empty(&dpm_list)) {
 		struct device *dev = to_device(dpm_list.prev);
+		u64 start;
 
 		get_device(dev);
 		mutex_unlock(&dpm_list_mtx);
 
 		dpm_drv_wdset(dev);
+		start = sched_clock();
 		error = suspend_device(dev, state);
+		dpm_profile_device(dev, DPM_PHASE_SUSPEND, start, error);
 		dpm_drv_wdclr(dev);
 
 		mutex_lock(&dpm_list_mtx);
@@ -812,6 +826,7 @@ int device_suspend(pm_message_t state)
 	int error;
 
 	might_sleep();
+	device_pm_profile_enter(DPM_POINT_DEVICES);
 	error = dpm_prepare(state);
 	if (!error)
 		error = dpm_suspend(state);
@@ -19,6 +19,23 @@ static inline struct device *to_device(struct list_head *entry)
 extern void device_pm_add(struct device *);
 extern void device_pm_remove(struct device *);
 
+/*
+ * profile.c
+ */
+
+enum dpm_phase {
+	DPM_PHASE_SUSPEND,
+	DPM_PHASE_SUSPEND_LATE,
+	DPM_PHASE_PLATFORM_ENTER,
+	DPM_PHASE_PLATFORM_EXIT,
+	DPM_PHASE_RESUME_EARLY,
+	DPM_PHASE_RESUME,
+	DPM_NR_PHASES,
+};
+
+extern void dpm_profile_device(struct device *dev, enum dpm_phase phase,
+			       u64 start, int error);
+
 #else /* CONFIG_PM_SLEEP */
 
 static inline void device_pm_add(struct device *dev) {}
@@ -0,0 +1,306 @@
+/*
+ * drivers/base/power/profile.c - Time spent in device PM callbacks.
+ *
+ * Every suspend/resume cycle accumulates the time spent in each phase and
+ * keeps the slowest individual callbacks.  A cycle runs from the outermost
+ * profile point entered (the wakelock suspend work, pm_suspend() or
+ * device_suspend()) until it is exited again, and records when each nested
+ * point was entered and exited.  The last completed cycle is shown in
+ * debugfs as "dpm_profile".
+ *
+ * Timestamps come from sched_clock(), since the noirq phases and the
+ * platform enter/exit run while timekeeping is suspended.
+ *
+ * This file is released under the GPLv2
+ */
+
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <trace/power.h>
+
+#include "power.h"
+
+DEFINE_TRACE(dpm_callback);
+DEFINE_TRACE(dpm_platform);
+DEFINE_TRACE(dpm_point);
+DEFINE_TRACE(dpm_cycle);
+
+#define DPM_PROFILE_SLOWEST	16
+
+struct dpm_profile_entry {
+	char name[24];
+	char driver[16];
+	u64 ns;
+	int error;
+	u8 phase;
+};
+
+struct dpm_profile_cycle {
+	unsigned long seq;
+	u64 start;
+	u64 total_ns;
+	u64 phase_ns[DPM_NR_PHASES];
+	unsigned int phase_calls[DPM_NR_PHASES];
+	unsigned int nr;
+	unsigned int min;	/* index of the fastest kept entry */
+	struct dpm_profile_entry slowest[DPM_PROFILE_SLOWEST];
+	unsigned int entered;	/* DPM_POINT_* bits */
+	unsigned int exited;
+	u64 enter_ns[DPM_NR_POINTS];	/* relative to start */
+	u64 exit_ns[DPM_NR_POINTS];
+};
+
+static DEFINE_SPINLOCK(dpm_profile_lock);
+static struct dpm_profile_cycle dpm_cur, dpm_last;
+static unsigned int dpm_profile_depth;
+static unsigned int dpm_open_points;	/* points entered, not yet exited */
+
+static const char *dpm_point_names[DPM_NR_POINTS] = {
+	[DPM_POINT_WAKELOCK_SUSPEND]	= "wakelock_suspend",
+	[DPM_POINT_PM_SUSPEND]		= "pm_suspend",
+	[DPM_POINT_DEVICES]		= "devices",
+};
+
+static const char *dpm_phase_names[DPM_NR_PHASES] = {
+	[DPM_PHASE_SUSPEND]		= "suspend",
+	[DPM_PHASE_SUSPEND_LATE]	= "suspend_late",
+	[DPM_PHASE_PLATFORM_ENTER]	= "platform_enter",
+	[DPM_PHASE_PLATFORM_EXIT]	= "platform_exit",
+	[DPM_PHASE_RESUME_EARLY]	= "resume_early",
+	[DPM_PHASE_RESUME]		= "resume",
+};
+
+/**
+ *	device_pm_profile_enter - Timestamp entry to a profile point.
+ *	@point:	Which point is entered.
+ *
+ *	Entering the outermost point starts a new cycle.  Entering a point
+ *	that is already open means its exit was missed, for example when
+ *	hibernation powered off, so the stale cycle is dropped.
+ */
+void device_pm_profile_enter(enum dpm_profile_point point)
+{
+	unsigned long flags;
+	u64 now = sched_clock();
+
+	trace_dpm_point(point, 0);
+
+	spin_lock_irqsave(&dpm_profile_lock, flags);
+	if (dpm_open_points & (1U << point))
+		dpm_profile_depth = 0;
+	if (!dpm_profile_depth++) {
+		memset(&dpm_cur, 0, sizeof(dpm_cur));
+		dpm_cur.seq = dpm_last.seq + 1;
+		dpm_cur.start = now;
+		dpm_open_points = 0;
+	}
+	dpm_open_points |= 1U << point;
+	dpm_cur.entered |= 1U << point;
+	dpm_cur.enter_ns[point] = now - dpm_cur.start;
+	spin_unlock_irqrestore(&dpm_profile_lock, flags);
+}
+EXPORT_SYMBOL_GPL(device_pm_profile_enter);
+
+/**
+ *	device_pm_profile_exit - Timestamp exit from a profile point.
+ *	@point:	Which point is exited.
+ *
+ *	Exiting the outermost point finishes the cycle and publishes it.
+ */
+void device_pm_profile_exit(enum dpm_profile_point point)
+{
+	unsigned long flags;
+	u64 now = sched_clock();
+	u64 total = 0;
+	unsigned int nr = 0;
+	int done = 0;
+
+	trace_dpm_point(point, 1);
+
+	spin_lock_irqsave(&dpm_profile_lock, flags);
+	if (dpm_open_points & (1U << point)) {
+		dpm_open_points &= ~(1U << point);
+		dpm_cur.exited |= 1U << point;
+		dpm_cur.exit_ns[point] = now - dpm_cur.start;
+		if (!--dpm_profile_depth) {
+			dpm_cur.total_ns = now - dpm_cur.start;
+			total = dpm_cur.total_ns;
+			nr = dpm_cur.phase_calls[DPM_PHASE_SUSPEND] +
+			     dpm_cur.phase_calls[DPM_PHASE_RESUME];
+			dpm_last = dpm_cur;
+			done = 1;
+		}
+	}
+	spin_unlock_irqrestore(&dpm_profile_lock, flags);
+
+	if (done)
+		trace_dpm_cycle(total, nr);
+}
+EXPORT_SYMBOL_GPL(device_pm_profile_exit);
+
+static void dpm_profile_record(const char *name, const char *driver,
+			       enum dpm_phase phase, u64 ns, int error)
+{
+	struct dpm_profile_cycle *c = &dpm_cur;
+	struct dpm_profile_entry *e;
+	unsigned int i;
+
+	c->phase_ns[phase] += ns;
+	c->phase_calls[phase]++;
+
+	if (c->nr < DPM_PROFILE_SLOWEST) {
+		e = &c->slowest[c->nr++];
+	} else if (ns > c->slowest[c->min].ns) {
+		e = &c->slowest[c->min];
+	} else {
+		return;
+	}
+
+	strlcpy(e->name, name, sizeof(e->name));
+	strlcpy(e->driver, driver, sizeof(e->driver));
+	e->ns = ns;
+	e->error = error;
+	e->phase = phase;
+
+	if (c->nr < DPM_PROFILE_SLOWEST)
+		return;
+	for (c->min = 0, i = 1; i < c->nr; i++)
+		if (c->slowest[i].ns < c->slowest[c->min].ns)
+			c->min = i;
+}
+
+/**
+ *	dpm_profile_device - Account one device PM callback.
+ *	@dev:	Device.
+ *	@phase:	Which callback was run.
+ *	@start:	sched_clock() value taken before the callback.
+ *	@error:	Value returned by the callback.
+ */
+void dpm_profile_device(struct device *dev, enum dpm_phase phase,
+			u64 start, int error)
+{
+	unsigned long flags;
+	u64 ns = sched_clock() - start;
+
+	trace_dpm_callback(dev, phase, ns, error);
+
+	spin_lock_irqsave(&dpm_profile_lock, flags);
+	dpm_profile_record(dev_name(dev),
+			   dev->driver ? dev->driver->name : "",
+			   phase, ns, error);
+	spin_unlock_irqrestore(&dpm_profile_lock, flags);
+}
+
+/**
+ *	device_pm_profile_platform - Account the platform sleep entry and exit.
+ *	@enter_ns:	Time from ->enter() until the system went to sleep.
+ *	@exit_ns:	Time from wakeup until ->enter() returned.
+ *
+ *	Called by platform code from its platform_suspend_ops ->enter().
+ */
+void device_pm_profile_platform(u64 enter_ns, u64 exit_ns)
+{
+	unsigned long flags;
+
+	trace_dpm_platform(enter_ns, exit_ns);
+
+	spin_lock_irqsave(&dpm_profile_lock, flags);
+	dpm_profile_record("platform", "", DPM_PHASE_PLATFORM_ENTER,
+			   enter_ns, 0);
+	dpm_profile_record("platform", "", DPM_PHASE_PLATFORM_EXIT,
+			   exit_ns, 0);
+	spin_unlock_irqrestore(&dpm_profile_lock, flags);
+}
+EXPORT_SYMBOL_GPL(device_pm_profile_platform);
+
+#ifdef CONFIG_DEBUG_FS
+static int dpm_profile_cmp(const void *a, const void *b)
+{
+	const struct dpm_profile_entry *x = a, *y = b;
+
+	if (x->ns == y->ns)
+		return 0;
+	return x->ns < y->ns ? 1 : -1;
+}
+
+static int dpm_profile_show(struct seq_file *m, void *unused)
+{
+	struct dpm_profile_cycle *c;
+	unsigned long flags;
+	unsigned int i;
+
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&dpm_profile_lock, flags);
+	*c = dpm_last;
+	spin_unlock_irqrestore(&dpm_profile_lock, flags);
+
+	sort(c->slowest, c->nr, sizeof(c->slowest[0]), dpm_profile_cmp, NULL);
+
+	seq_printf(m, "cycle\t%lu\ntotal\t%llu us\n\n", c->seq,
+		   (unsigned long long)div_u64(c->total_ns, NSEC_PER_USEC));
+	seq_printf(m, "point\tenter_us\texit_us\n");
+	for (i = 0; i < DPM_NR_POINTS; i++) {
+		if (!(c->entered & (1U << i)))
+			continue;
+		seq_printf(m, "%s\t%llu\t", dpm_point_names[i],
+			   (unsigned long long)div_u64(c->enter_ns[i],
+						       NSEC_PER_USEC));
+		if (c->exited & (1U << i))
+			seq_printf(m, "%llu\n",
+				   (unsigned long long)div_u64(c->exit_ns[i],
+							       NSEC_PER_USEC));
+		else
+			seq_printf(m, "-\n");
+	}
+
+	seq_printf(m, "\nphase\tcalls\ttotal_us\n");
+	for (i = 0; i < DPM_NR_PHASES; i++)
+		seq_printf(m, "%s\t%u\t%llu\n", dpm_phase_names[i],
+			   c->phase_calls[i],
+			   (unsigned long long)div_u64(c->phase_ns[i],
+						       NSEC_PER_USEC));
+
+	seq_printf(m, "\nphase\ttime_us\terror\tdevice\tdriver\n");
+	for (i = 0; i < c->nr; i++) {
+		struct dpm_profile_entry *e = &c->slowest[i];
+
+		seq_printf(m, "%s\t%llu\t%d\t%s\t%s\n",
+			   dpm_phase_names[e->phase],
+			   (unsigned long long)div_u64(e->ns, NSEC_PER_USEC),
+			   e->error, e->name, e->driver);
+	}
+
+	kfree(c);
+	return 0;
+}
+
+static int dpm_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dpm_profile_show, NULL);
+}
+
+static const struct file_operations dpm_profile_fops = {
+	.open = dpm_profile_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init dpm_profile_init(void)
+{
+	debugfs_create_file("dpm_profile", S_IRUGO, NULL, NULL,
+			    &dpm_profile_fops);
+	return 0;
+}
+late_initcall(dpm_profile_init);
+#endif
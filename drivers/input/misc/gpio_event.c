@@ -173,6 +173,7 @@ static int __init gpio_event_probe(struct platform_device *pdev)
 		ip->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
 		ip->early_suspend.suspend = gpio_event_suspend;
 		ip->early_suspend.resume = gpio_event_resume;
+		ip->early_suspend.parallel = 1;
 		register_early_suspend(&ip->early_suspend);
 #endif
 		ip->info->power(ip->info, 1);
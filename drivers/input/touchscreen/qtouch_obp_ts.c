@@ -1007,6 +1007,7 @@ static int qtouch_ts_probe(struct i2c_client *client,
 	ts->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
 	ts->early_suspend.suspend = qtouch_ts_early_suspend;
 	ts->early_suspend.resume = qtouch_ts_late_resume;
+	ts->early_suspend.parallel = 1;
 	register_early_suspend(&ts->early_suspend);
 #endif
 
@@ -535,6 +535,7 @@ static int synaptics_ts_probe(
 	ts->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
 	ts->early_suspend.suspend = synaptics_ts_early_suspend;
 	ts->early_suspend.resume = synaptics_ts_late_resume;
+	ts->early_suspend.parallel = 1;
 	register_early_suspend(&ts->early_suspend);
 #endif
 
@@ -780,6 +780,7 @@ int akm8973_probe(struct i2c_client *client, const struct i2c_device_id *devid)
 	akm->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
 	akm->early_suspend.suspend = akm8973_early_suspend;
 	akm->early_suspend.resume = akm8973_late_resume;
+	akm->early_suspend.parallel = 1;
 	register_early_suspend(&akm->early_suspend);
 #endif
 	return 0;
@@ -687,6 +687,7 @@ static int lis331dlh_probe(struct i2c_client *client,
 	lis->early_suspend.level = EARLY_SUSPEND_LEVEL_BLANK_SCREEN + 1;
 	lis->early_suspend.suspend = lis331dlh_early_suspend;
 	lis->early_suspend.resume = lis331dlh_late_resume;
+	lis->early_suspend.parallel = 1;
 	register_early_suspend(&lis->early_suspend);
 #endif
 
@@ -29,6 +29,8 @@
 
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
+/* number of per-order free lists, enough for any num_entries */
+#define PMEM_NR_ORDERS (sizeof(unsigned long) * 8)
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -82,6 +84,9 @@ struct pmem_data {
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
 	unsigned order:7;		/* size of the region in pmem space */
+	/* on free_area[order] while this entry heads a free region,
+	 * empty otherwise */
+	struct list_head free_list;
 };
 
 struct pmem_region_node {
@@ -116,6 +121,12 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* free regions by order, and how many there are of each */
+	struct list_head free_area[PMEM_NR_ORDERS];
+	unsigned long free_count[PMEM_NR_ORDERS];
+	/* time spent in the allocator, updated with the bitmap write lock */
+	unsigned long alloc_calls, alloc_fails, free_calls;
+	u64 alloc_ns, alloc_max_ns, free_ns, free_max_ns;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -131,7 +142,7 @@ struct pmem_info {
 	 * needed */
 	struct semaphore data_list_sem;
 	struct list_head data_list;
-	/* pmem_sem protects the bitmap array
+	/* pmem_sem protects the bitmap array and the free lists
 	 * a write lock should be held when modifying entries in bitmap
 	 * a read lock should be held when reading data from bits or
 	 * dereferencing a pointer into bitmap
@@ -232,34 +243,70 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
-static int pmem_free(int id, int index)
+static void pmem_add_free(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+
+	list_add(&pmem[id].bitmap[index].free_list, &pmem[id].free_area[order]);
+	pmem[id].free_count[order]++;
+}
+
+static void pmem_del_free(int id, int index)
+{
+	list_del_init(&pmem[id].bitmap[index].free_list);
+	pmem[id].free_count[PMEM_ORDER(id, index)]--;
+}
+
+static void pmem_account(u64 start, unsigned long *calls, u64 *total,
+			 u64 *max)
+{
+	u64 ns = sched_clock() - start;
+
+	(*calls)++;
+	*total += ns;
+	if (ns > *max)
+		*max = ns;
+}
+
+static void __pmem_free(int id, int index)
 {
-	/* caller should hold the write lock on pmem_sem! */
 	int buddy, curr = index;
-	DLOG("index %d\n", index);
 
-	if (pmem[id].no_allocator) {
-		pmem[id].allocated = 0;
-		return 0;
-	}
 	/* clean up the bitmap, merging any buddies */
 	pmem[id].bitmap[curr].allocated = 0;
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
+	 * if the buddy heads a free region of the same order merge them
+	 * repeat until the buddy is not free or lies past the end of the bitmap
 	 */
-	do {
+	for (;;) {
 		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
+		if (buddy >= pmem[id].num_entries ||
+		    list_empty(&pmem[id].bitmap[buddy].free_list) ||
+		    PMEM_ORDER(id, buddy) != PMEM_ORDER(id, curr))
 			break;
-		}
-	} while (curr < pmem[id].num_entries);
+		pmem_del_free(id, buddy);
+		PMEM_ORDER(id, buddy)++;
+		PMEM_ORDER(id, curr)++;
+		curr = min(buddy, curr);
+	}
+	pmem_add_free(id, curr);
+}
+
+static int pmem_free(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	u64 start;
+	DLOG("index %d\n", index);
 
+	if (pmem[id].no_allocator) {
+		pmem[id].allocated = 0;
+		return 0;
+	}
+
+	start = sched_clock();
+	__pmem_free(id, index);
+	pmem_account(start, &pmem[id].free_calls, &pmem[id].free_ns,
+		     &pmem[id].free_max_ns);
 	return 0;
 }
 
@@ -376,44 +423,28 @@ static unsigned long pmem_order(unsigned long len)
 	return i;
 }
 
-static int pmem_allocate(int id, unsigned long len)
+static int __pmem_allocate(int id, unsigned long len)
 {
-	/* caller should hold the write lock on pmem_sem! */
-	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
 	int best_fit = -1;
-	unsigned long order = pmem_order(len);
+	unsigned long curr, order = pmem_order(len);
 
-	if (pmem[id].no_allocator) {
-		DLOG("no allocator");
-		if ((len > pmem[id].size) || pmem[id].allocated)
-			return -1;
-		pmem[id].allocated = 1;
-		return len;
-	}
-
-	if (order > PMEM_MAX_ORDER)
+	if (order > PMEM_MAX_ORDER || order >= PMEM_NR_ORDERS)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
+	/* take the best fit: the first free slot of the smallest order that
+	 * is at least as large as the request
 	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
+	for (curr = order; curr < PMEM_NR_ORDERS; curr++) {
+		struct pmem_bits *bits;
+
+		if (list_empty(&pmem[id].free_area[curr]))
+			continue;
+		bits = list_first_entry(&pmem[id].free_area[curr],
+					struct pmem_bits, free_list);
+		best_fit = bits - pmem[id].bitmap;
+		pmem_del_free(id, best_fit);
+		break;
 	}
 
 	/* if best_fit < 0, there are no suitable slots,
@@ -433,11 +464,36 @@ static int pmem_allocate(int id, unsigned long len)
 		PMEM_ORDER(id, best_fit) -= 1;
 		buddy = PMEM_BUDDY_INDEX(id, best_fit);
 		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		pmem_add_free(id, buddy);
 	}
 	pmem[id].bitmap[best_fit].allocated = 1;
 	return best_fit;
 }
 
+static int pmem_allocate(int id, unsigned long len)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	/* return the corresponding pdata[] entry */
+	int index;
+	u64 start;
+
+	if (pmem[id].no_allocator) {
+		DLOG("no allocator");
+		if ((len > pmem[id].size) || pmem[id].allocated)
+			return -1;
+		pmem[id].allocated = 1;
+		return len;
+	}
+
+	start = sched_clock();
+	index = __pmem_allocate(id, len);
+	pmem_account(start, &pmem[id].alloc_calls, &pmem[id].alloc_ns,
+		     &pmem[id].alloc_max_ns);
+	if (index < 0)
+		pmem[id].alloc_fails++;
+	return index;
+}
+
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -1206,6 +1262,62 @@ static struct file_operations debug_fops = {
 	.read = debug_read,
 	.open = debug_open,
 };
+
+static ssize_t debug_frag_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	int id = (int)file->private_data;
+	const int debug_bufmax = 2048;
+	static char buffer[2048];
+	unsigned long free_bytes = 0, largest = 0;
+	unsigned long alloc_calls, alloc_fails, free_calls;
+	u64 alloc_ns, alloc_max_ns, free_ns, free_max_ns;
+	int i, n = 0;
+
+	if (pmem[id].no_allocator)
+		return 0;
+
+	down_read(&pmem[id].bitmap_sem);
+	n += scnprintf(buffer + n, debug_bufmax - n,
+		       "order: free regions (bytes)\n");
+	for (i = 0; i < PMEM_NR_ORDERS; i++) {
+		unsigned long bytes;
+
+		if (!pmem[id].free_count[i])
+			continue;
+		bytes = pmem[id].free_count[i] * PMEM_MIN_ALLOC << i;
+		free_bytes += bytes;
+		largest = PMEM_MIN_ALLOC << i;
+		n += scnprintf(buffer + n, debug_bufmax - n, "%d: %lu (%lu)\n",
+			       i, pmem[id].free_count[i], bytes);
+	}
+	alloc_calls = pmem[id].alloc_calls;
+	alloc_fails = pmem[id].alloc_fails;
+	alloc_ns = pmem[id].alloc_ns;
+	alloc_max_ns = pmem[id].alloc_max_ns;
+	free_calls = pmem[id].free_calls;
+	free_ns = pmem[id].free_ns;
+	free_max_ns = pmem[id].free_max_ns;
+	up_read(&pmem[id].bitmap_sem);
+
+	n += scnprintf(buffer + n, debug_bufmax - n,
+		       "total %lu free %lu largest free %lu\n",
+		       pmem[id].size, free_bytes, largest);
+	n += scnprintf(buffer + n, debug_bufmax - n,
+		       "allocs %lu failed %lu time %llu ns max %llu ns\n"
+		       "frees %lu time %llu ns max %llu ns\n",
+		       alloc_calls, alloc_fails,
+		       (unsigned long long)alloc_ns,
+		       (unsigned long long)alloc_max_ns, free_calls,
+		       (unsigned long long)free_ns,
+		       (unsigned long long)free_max_ns);
+	return simple_read_from_buffer(buf, count, ppos, buffer, n);
+}
+
+static struct file_operations debug_frag_fops = {
+	.read = debug_frag_read,
+	.open = debug_open,
+};
 #endif
 
 #if 0
@@ -1253,10 +1365,17 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
+	for (i = 0; i < pmem[id].num_entries; i++)
+		INIT_LIST_HEAD(&pmem[id].bitmap[i].free_list);
+	for (i = 0; i < PMEM_NR_ORDERS; i++) {
+		INIT_LIST_HEAD(&pmem[id].free_area[i]);
+		pmem[id].free_count[i] = 0;
+	}
 
 	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
-		if ((pmem[id].num_entries) &  1<<i) {
+		if ((pmem[id].num_entries) &  1UL<<i) {
 			PMEM_ORDER(id, index) = i;
+			pmem_add_free(id, index);
 			index = PMEM_NEXT_INDEX(id, index);
 		}
 	}
@@ -1282,6 +1401,13 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #if PMEM_DEBUG
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
+	if (!pmem[id].no_allocator) {
+		char frag_name[64];
+
+		snprintf(frag_name, sizeof(frag_name), "%s_frag", pdata->name);
+		debugfs_create_file(frag_name, S_IFREG | S_IRUGO, NULL,
+				    (void *)id, &debug_frag_fops);
+	}
 #endif
 	return 0;
 error_cant_remap:
@@ -13,55 +13,87 @@
  *
  */
 
-#include <asm/atomic.h>
-
 #include <linux/err.h>
+#include <linux/hash.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
-#include <linux/spinlock.h>
 #include <linux/stat.h>
 #include <linux/uid_stat.h>
 
-static DEFINE_SPINLOCK(uid_lock);
-static LIST_HEAD(uid_list);
+#define UID_HASH_BITS	6
+#define UID_HASH_SIZE	(1 << UID_HASH_BITS)
+
+/*
+ * Entries are never removed, so lookups only need rcu_read_lock() to walk
+ * a chain safely while a new entry is being added to it, and the entry
+ * found stays valid after the lock is dropped.  uid_create_lock serializes
+ * creation so a uid never gets two entries.
+ */
+static DEFINE_MUTEX(uid_create_lock);
+static struct hlist_head uid_hash[UID_HASH_SIZE];
 static struct proc_dir_entry *parent;
 
+struct uid_stat_cpu {
+	unsigned int tcp_rcv;
+	unsigned int tcp_snd;
+};
+
 struct uid_stat {
-	struct list_head link;
+	struct hlist_node link;
 	uid_t uid;
-	atomic_t tcp_rcv;
-	atomic_t tcp_snd;
+	struct uid_stat_cpu *stats;	/* per cpu */
 };
 
 static struct uid_stat *find_uid_stat(uid_t uid) {
-	unsigned long flags;
 	struct uid_stat *entry;
+	struct hlist_node *pos;
 
-	spin_lock_irqsave(&uid_lock, flags);
-	list_for_each_entry(entry, &uid_list, link) {
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(entry, pos,
+			&uid_hash[hash_long(uid, UID_HASH_BITS)], link) {
 		if (entry->uid == uid) {
-			spin_unlock_irqrestore(&uid_lock, flags);
+			rcu_read_unlock();
 			return entry;
 		}
 	}
-	spin_unlock_irqrestore(&uid_lock, flags);
+	rcu_read_unlock();
 	return NULL;
 }
 
+/* Counters wrap at 4GB of network traffic, as they always have. */
+static void read_uid_stat(struct uid_stat *uid_entry, unsigned int *tcp_snd,
+			  unsigned int *tcp_rcv)
+{
+	int cpu;
+
+	*tcp_snd = 0;
+	*tcp_rcv = 0;
+	for_each_possible_cpu(cpu) {
+		struct uid_stat_cpu *stats = per_cpu_ptr(uid_entry->stats, cpu);
+
+		*tcp_snd += stats->tcp_snd;
+		*tcp_rcv += stats->tcp_rcv;
+	}
+}
+
 static int tcp_snd_read_proc(char *page, char **start, off_t off,
 				int count, int *eof, void *data)
 {
 	int len;
-	unsigned int bytes;
+	unsigned int bytes, unused;
 	char *p = page;
 	struct uid_stat *uid_entry = (struct uid_stat *) data;
 	if (!data)
 		return 0;
 
-	bytes = (unsigned int) (atomic_read(&uid_entry->tcp_snd) + INT_MIN);
+	read_uid_stat(uid_entry, &bytes, &unused);
 	p += sprintf(p, "%u\n", bytes);
 	len = (p - page) - off;
 	*eof = (len <= count) ? 1 : 0;
@@ -73,13 +105,13 @@ static int tcp_rcv_read_proc(char *page, char **start, off_t off,
 				int count, int *eof, void *data)
 {
 	int len;
-	unsigned int bytes;
+	unsigned int bytes, unused;
 	char *p = page;
 	struct uid_stat *uid_entry = (struct uid_stat *) data;
 	if (!data)
 		return 0;
 
-	bytes = (unsigned int) (atomic_read(&uid_entry->tcp_rcv) + INT_MIN);
+	read_uid_stat(uid_entry, &unused, &bytes);
 	p += sprintf(p, "%u\n", bytes);
 	len = (p - page) - off;
 	*eof = (len <= count) ? 1 : 0;
@@ -87,25 +119,64 @@ static int tcp_rcv_read_proc(char *page, char **start, off_t off,
 	return len;
 }
 
+/* One line per uid: "uid tcp_snd tcp_rcv" */
+static int uid_stat_all_show(struct seq_file *m, void *v)
+{
+	struct uid_stat *entry;
+	struct hlist_node *pos;
+	unsigned int tcp_snd, tcp_rcv;
+	int i;
+
+	rcu_read_lock();
+	for (i = 0; i < UID_HASH_SIZE; i++) {
+		hlist_for_each_entry_rcu(entry, pos, &uid_hash[i], link) {
+			read_uid_stat(entry, &tcp_snd, &tcp_rcv);
+			seq_printf(m, "%u %u %u\n", entry->uid, tcp_snd,
+				   tcp_rcv);
+		}
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int uid_stat_all_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, uid_stat_all_show, NULL);
+}
+
+static const struct file_operations uid_stat_all_fops = {
+	.open		= uid_stat_all_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /* Create a new entry for tracking the specified uid. */
 static struct uid_stat *create_stat(uid_t uid) {
-	unsigned long flags;
 	char uid_s[32];
 	struct uid_stat *new_uid;
 	struct proc_dir_entry *entry;
 
-	/* Create the uid stat struct and append it to the list. */
+	mutex_lock(&uid_create_lock);
+	/* Somebody else may have created it while we waited for the lock. */
+	new_uid = find_uid_stat(uid);
+	if (new_uid)
+		goto out;
+
+	/* Create the uid stat struct and add it to the hash. */
 	if ((new_uid = kmalloc(sizeof(struct uid_stat), GFP_KERNEL)) == NULL)
-		return NULL;
+		goto out;
 
 	new_uid->uid = uid;
-	/* Counters start at INT_MIN, so we can track 4GB of network traffic. */
-	atomic_set(&new_uid->tcp_rcv, INT_MIN);
-	atomic_set(&new_uid->tcp_snd, INT_MIN);
+	new_uid->stats = alloc_percpu(struct uid_stat_cpu);
+	if (!new_uid->stats) {
+		kfree(new_uid);
+		new_uid = NULL;
+		goto out;
+	}
 
-	spin_lock_irqsave(&uid_lock, flags);
-	list_add_tail(&new_uid->link, &uid_list);
-	spin_unlock_irqrestore(&uid_lock, flags);
+	hlist_add_head_rcu(&new_uid->link,
+			   &uid_hash[hash_long(uid, UID_HASH_BITS)]);
 
 	sprintf(uid_s, "%d", uid);
 	entry = proc_mkdir(uid_s, parent);
@@ -116,7 +187,8 @@ static struct uid_stat *create_stat(uid_t uid) {
 
 	create_proc_read_entry("tcp_rcv", S_IRUGO, entry, tcp_rcv_read_proc,
 		(void *) new_uid);
-
+out:
+	mutex_unlock(&uid_create_lock);
 	return new_uid;
 }
 
@@ -126,7 +198,8 @@ int update_tcp_snd(uid_t uid, int size) {
 		((entry = create_stat(uid)) == NULL)) {
 			return -1;
 	}
-	atomic_add(size, &entry->tcp_snd);
+	per_cpu_ptr(entry->stats, get_cpu())->tcp_snd += size;
+	put_cpu();
 	return 0;
 }
 
@@ -136,7 +209,8 @@ int update_tcp_rcv(uid_t uid, int size) {
 		((entry = create_stat(uid)) == NULL)) {
 			return -1;
 	}
-	atomic_add(size, &entry->tcp_rcv);
+	per_cpu_ptr(entry->stats, get_cpu())->tcp_rcv += size;
+	put_cpu();
 	return 0;
 }
 
@@ -147,6 +221,8 @@ static int __init uid_stat_init(void)
 		pr_err("uid_stat: failed to create proc entry\n");
 		return -1;
 	}
+	/* All uids in one read, not a walk over the per uid directories */
+	proc_create("all", S_IRUGO, parent, &uid_stat_all_fops);
 	return 0;
 }
 
@@ -31,8 +31,25 @@
 #include <linux/sched.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <trace/binder.h>
 #include "binder.h"
 
+DEFINE_TRACE(binder_transaction);
+DEFINE_TRACE(binder_transaction_received);
+DEFINE_TRACE(binder_reply);
+DEFINE_TRACE(binder_buffer_alloc);
+DEFINE_TRACE(binder_buffer_free);
+
+/*
+ * binder_lock protects the object graph: the proc list, threads, nodes,
+ * refs, todo lists and transaction stacks, for all procs alike.  Only the
+ * buffer allocator is split out: each proc's has its own alloc_lock, which
+ * may be taken inside binder_lock but never the other way around, so that
+ * buffer allocation, page mapping and the copy of transaction payloads can
+ * run without holding binder_lock.  Anything that drops binder_lock to do
+ * so must revalidate the threads, nodes and procs it looked up before.
+ */
 static DEFINE_MUTEX(binder_lock);
 static HLIST_HEAD(binder_procs);
 static struct binder_node *binder_context_mgr_node;
@@ -43,6 +60,9 @@ static struct proc_dir_entry *binder_proc_dir_entry_proc;
 static struct hlist_head binder_dead_nodes;
 static HLIST_HEAD(binder_deferred_list);
 static DEFINE_MUTEX(binder_deferred_lock);
+static LIST_HEAD(binder_lru);
+static DEFINE_SPINLOCK(binder_lru_lock);
+static int binder_lru_pages;
 
 static int binder_read_proc_proc(
 	char *page, char **start, off_t off, int count, int *eof, void *data);
@@ -118,13 +138,49 @@ enum {
 
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	int bc[_IOC_NR(BC_REPLY_SG) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
+	int sg_buffers;
+	size_t sg_bytes;
+	size_t copy_bytes;	/* transaction payload copied in */
+	u64 copy_ns;		/* and the time spent copying it */
 };
 
 static struct binder_stats binder_stats;
 
+/*
+ * Log2 histogram of latencies in microseconds: bucket 0 counts anything
+ * under 1us, bucket n counts [2^(n-1), 2^n) us and the last bucket
+ * everything above.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+struct binder_latency_hist {
+	unsigned int bucket[BINDER_LATENCY_BUCKETS];
+	u64 total_us;
+	unsigned int count;
+};
+
+static void binder_latency_add(struct binder_latency_hist *hist, u64 ns)
+{
+	u64 us = ns;
+	int i;
+
+	do_div(us, NSEC_PER_USEC);
+	i = us ? fls64(us) : 0;
+	if (i >= BINDER_LATENCY_BUCKETS)
+		i = BINDER_LATENCY_BUCKETS - 1;
+	hist->bucket[i]++;
+	hist->total_us += us;
+	hist->count++;
+}
+
+static u64 binder_now_ns(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -191,10 +247,20 @@ struct binder_node {
 	unsigned pending_weak_ref : 1;
 	unsigned has_async_transaction : 1;
 	unsigned accept_fds : 1;
+	unsigned sched_policy : 2;
 	int min_priority : 8;
 	struct list_head async_todo;
 };
 
+/*
+ * prio is the rt_priority for SCHED_FIFO and SCHED_RR and the nice value
+ * for the other policies.
+ */
+struct binder_priority {
+	int sched_policy;
+	int prio;
+};
+
 struct binder_ref_death {
 	struct binder_work work;
 	void __user *cookie;
@@ -231,9 +297,16 @@ struct binder_buffer {
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size;
 	uint8_t data[0];
 };
 
+struct binder_lru_page {
+	struct list_head lru;	/* on binder_lru while cached */
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
 enum {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -252,16 +325,26 @@ struct binder_proc {
 	struct files_struct *files;
 	struct hlist_node deferred_work_node;
 	int deferred_work;
+	int tmp_ref;
+	int is_dead;
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock;
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	int pages_mapped;
+	int pages_high;
+	int pages_lru;
+	int page_cache_hits;
+	int page_cache_reclaimed;
 	size_t buffer_size;
+	size_t buffer_used;
+	size_t buffer_used_high;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
@@ -271,7 +354,10 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
+	struct binder_latency_hist queue_latency;	/* todo to delivery */
+	struct binder_latency_hist service_latency;	/* delivery to reply */
+	struct binder_latency_hist rt_service_latency;	/* same, RT callers */
 };
 
 enum {
@@ -312,12 +398,15 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	u64	queued_ns;
+	u64	delivered_ns;
 };
 
 static void binder_defer_work(struct binder_proc *proc, int defer);
+static void binder_free_proc(struct binder_proc *proc);
 
 /*
  * copied from get_unused_fd_flags
@@ -474,6 +563,79 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_is_rt_policy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_get_priority(struct task_struct *task,
+				struct binder_priority *prio)
+{
+	prio->sched_policy = task->policy;
+	if (binder_is_rt_policy(task->policy))
+		prio->prio = task->rt_priority;
+	else
+		prio->prio = task_nice(task);
+}
+
+/* Whether current may ask for its nodes to be serviced at this priority */
+static int binder_can_use_rt_priority(int prio)
+{
+	if (prio <= 0 || prio >= MAX_USER_RT_PRIO)
+		return 0;
+	return prio <= current->signal->rlim[RLIMIT_RTPRIO].rlim_cur ||
+		capable(CAP_SYS_NICE);
+}
+
+/* Returns non-zero if a runs ahead of b. */
+static int binder_priority_higher(struct binder_priority *a,
+				  struct binder_priority *b)
+{
+	if (binder_is_rt_policy(a->sched_policy))
+		return !binder_is_rt_policy(b->sched_policy) ||
+			a->prio > b->prio;
+	if (binder_is_rt_policy(b->sched_policy))
+		return 0;
+	return a->prio < b->prio;
+}
+
+/*
+ * Switch the current thread to the given policy and priority.  RT
+ * policies only ever come from a caller that was already running with
+ * them, or from a node whose owner was allowed to use them, so they are
+ * applied without the usual permission checks; nice values still go
+ * through binder_set_nice() and its RLIMIT_NICE handling.
+ */
+static void binder_set_priority(struct binder_priority *prio)
+{
+	struct sched_param param;
+	int ret;
+
+	if (binder_is_rt_policy(prio->sched_policy)) {
+		if (current->policy == prio->sched_policy &&
+		    current->rt_priority == prio->prio)
+			return;
+		param.sched_priority = prio->prio;
+		ret = sched_setscheduler_nocheck(current, prio->sched_policy,
+						 &param);
+		if (ret)
+			binder_user_error("binder: %d: failed to set policy "
+				"%d prio %d, %d\n", current->pid,
+				prio->sched_policy, prio->prio, ret);
+		return;
+	}
+	if (current->policy != prio->sched_policy) {
+		param.sched_priority = 0;
+		ret = sched_setscheduler_nocheck(current, prio->sched_policy,
+						 &param);
+		if (ret)
+			binder_user_error("binder: %d: failed to set policy "
+				"%d, %d\n", current->pid,
+				prio->sched_policy, ret);
+	}
+	binder_set_nice(prio->prio);
+}
+
 static size_t binder_buffer_size(
 	struct binder_proc *proc, struct binder_buffer *buffer)
 {
@@ -566,13 +728,62 @@ static struct binder_buffer *binder_buffer_lookup(
 	return NULL;
 }
 
+static void binder_lru_add(struct binder_proc *proc,
+			   struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	list_add(&page->lru, &binder_lru);
+	binder_lru_pages++;
+	spin_unlock(&binder_lru_lock);
+	proc->pages_lru++;
+}
+
+static int binder_lru_del(struct binder_proc *proc,
+			  struct binder_lru_page *page)
+{
+	int on_lru;
+
+	spin_lock(&binder_lru_lock);
+	on_lru = !list_empty(&page->lru);
+	if (on_lru) {
+		list_del_init(&page->lru);
+		binder_lru_pages--;
+	}
+	spin_unlock(&binder_lru_lock);
+	if (on_lru)
+		proc->pages_lru--;
+	return on_lru;
+}
+
+static void binder_unmap_page(struct binder_proc *proc,
+	struct binder_lru_page *page, struct vm_area_struct *vma)
+{
+	void *page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+
+	if (vma)
+		zap_page_range(vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+	proc->pages_mapped--;
+}
+
+/*
+ * Pages of freed buffers are not unmapped straight away but parked on
+ * binder_lru, still mapped in both the kernel and the process, so that
+ * the next transaction that needs them does not pay for alloc_page(),
+ * map_vm_area() and vm_insert_page() again.  binder_shrink() gives them
+ * back when the system is short on memory.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *start, void *end, struct vm_area_struct *vma)
 {
 	void *page_addr;
+	void *first = start;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *page;
 	struct mm_struct *mm;
 
 	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
@@ -582,6 +793,27 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0) {
+		for (page_addr = start; page_addr < end;
+		     page_addr += PAGE_SIZE) {
+			page = &proc->pages[(page_addr - proc->buffer) /
+					    PAGE_SIZE];
+			BUG_ON(!page->page_ptr);
+			binder_lru_add(proc, page);
+		}
+		return 0;
+	}
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!page->page_ptr || !binder_lru_del(proc, page))
+			break;
+		proc->page_cache_hits++;
+	}
+	if (page_addr >= end)
+		return 0;
+	start = page_addr;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -592,13 +824,11 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
-		goto err_no_vma;
+		page_addr = start;
+		goto err_alloc_page_failed;
 	}
 
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
@@ -606,16 +836,20 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr) {
+			BUG_ON(!binder_lru_del(proc, page));
+			proc->page_cache_hits++;
+			continue;
+		}
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -625,14 +859,21 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
 			       proc->pid, user_page_addr);
 			goto err_vm_insert_page_failed;
 		}
-		/* vm_insert_page does not seem to increment the refcount */
+		/*
+		 * vm_insert_page() takes a page reference of its own for the
+		 * user mapping; zap_page_range() drops it again, and ours goes
+		 * in binder_unmap_page().
+		 */
+		proc->pages_mapped++;
+		if (proc->pages_mapped > proc->pages_high)
+			proc->pages_high = proc->pages_mapped;
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -640,22 +881,14 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
-err_no_vma:
+	/* the pages mapped so far stay cached for the next attempt */
+	binder_update_page_range(proc, 0, first, page_addr, NULL);
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -663,8 +896,68 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-	size_t data_size, size_t offsets_size, int is_async)
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	struct mm_struct *mm;
+	int freed;
+
+	if (nr_to_scan <= 0)
+		return binder_lru_pages;
+
+	spin_lock(&binder_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&binder_lru)) {
+		page = list_entry(binder_lru.prev, struct binder_lru_page, lru);
+		proc = page->proc;
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move(&page->lru, &binder_lru);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_lru_pages--;
+		spin_unlock(&binder_lru_lock);
+
+		/*
+		 * Holding alloc_lock keeps the proc alive: binder_free_proc()
+		 * takes it before it drops the cached pages.  The page is
+		 * still mapped in the process, so it can only go if we can
+		 * pin the mm and zap the user mapping; a proc whose mm is
+		 * already gone keeps its pages until binder_free_proc().
+		 */
+		freed = 0;
+		mm = get_task_mm(proc->tsk);
+		if (mm && down_read_trylock(&mm->mmap_sem)) {
+			proc->pages_lru--;
+			binder_unmap_page(proc, page, proc->vma);
+			proc->page_cache_reclaimed++;
+			freed = 1;
+			up_read(&mm->mmap_sem);
+		}
+		if (mm)
+			mmput(mm);
+		if (!freed) {
+			spin_lock(&binder_lru_lock);
+			list_add(&page->lru, &binder_lru);
+			binder_lru_pages++;
+			spin_unlock(&binder_lru_lock);
+		}
+		mutex_unlock(&proc->alloc_lock);
+		spin_lock(&binder_lru_lock);
+	}
+	spin_unlock(&binder_lru_lock);
+
+	return binder_lru_pages;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS
+};
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+	size_t data_size, size_t offsets_size, size_t extra_buffers_size,
+	int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -688,6 +981,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size += ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra_buffers_size %zd\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -755,7 +1055,12 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		       "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
+	proc->buffer_used += size + sizeof(struct binder_buffer);
+	if (proc->buffer_used > proc->buffer_used_high)
+		proc->buffer_used_high = proc->buffer_used;
+	trace_binder_buffer_alloc(proc->pid, size, is_async);
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC_ASYNC)
@@ -767,6 +1072,19 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+	size_t data_size, size_t offsets_size, size_t extra_buffers_size,
+	int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 extra_buffers_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -824,7 +1142,7 @@ static void binder_delete_free_buffer(
 	}
 }
 
-static void binder_free_buf(
+static void binder_free_buf_locked(
 	struct binder_proc *proc, struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
@@ -832,7 +1150,8 @@ static void binder_free_buf(
 	buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
 	if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
 		printk(KERN_INFO "binder: %d: binder_free_buf %p size %zd buffer"
 		       "_size %zd\n", proc->pid, buffer, size, buffer_size);
@@ -843,6 +1162,9 @@ static void binder_free_buf(
 	BUG_ON((void *)buffer < proc->buffer);
 	BUG_ON((void *)buffer > proc->buffer + proc->buffer_size);
 
+	proc->buffer_used -= size + sizeof(struct binder_buffer);
+	trace_binder_buffer_free(proc->pid, size);
+
 	if (buffer->async_transaction) {
 		proc->free_async_space += size + sizeof(struct binder_buffer);
 		if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC_ASYNC)
@@ -877,6 +1199,14 @@ static void binder_free_buf(
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(
+	struct binder_proc *proc, struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	binder_free_buf_locked(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
 static struct binder_node *
 binder_get_node(struct binder_proc *proc, void __user *ptr)
 {
@@ -1257,9 +1587,92 @@ static void
 binder_transaction_buffer_release(struct binder_proc *proc,
 			struct binder_buffer *buffer, size_t *failed_at);
 
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	proc->tmp_ref--;
+	if (proc->is_dead && proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
+/*
+ * Copy the blocks described by BINDER_TYPE_PTR objects into the extra
+ * buffers area that follows the offsets, and point the objects at the
+ * copies as seen by the target.  Offsets that are out of range are left
+ * for binder_transaction() to reject.  Returns the number of blocks
+ * copied, or a negative error.
+ */
+static int
+binder_copy_sg_buffers(struct binder_proc *proc, struct binder_thread *thread,
+	struct binder_proc *target_proc, struct binder_buffer *buffer,
+	size_t *sg_bytes)
+{
+	size_t *offp, *off_end;
+	uint8_t *sg_bufp, *sg_buf_end;
+	int count = 0;
+
+	offp = (size_t *)(buffer->data +
+			  ALIGN(buffer->data_size, sizeof(void *)));
+	off_end = offp + buffer->offsets_size / sizeof(size_t);
+	sg_bufp = (uint8_t *)offp + ALIGN(buffer->offsets_size, sizeof(void *));
+	sg_buf_end = sg_bufp + buffer->extra_buffers_size;
+	*sg_bytes = 0;
+
+	for (; offp < off_end; offp++) {
+		struct binder_buffer_object *bp;
+		size_t len;
+
+		if (*offp > buffer->data_size - sizeof(*bp) ||
+		    buffer->data_size < sizeof(*bp) ||
+		    !IS_ALIGNED(*offp, sizeof(void *)))
+			continue;
+		bp = (struct binder_buffer_object *)(buffer->data + *offp);
+		if (bp->type != BINDER_TYPE_PTR)
+			continue;
+
+		len = ALIGN(bp->length, sizeof(void *));
+		if (len < bp->length || len > sg_buf_end - sg_bufp) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"too large buffer object, %zd of %zd left\n",
+				proc->pid, thread->pid, bp->length,
+				(size_t)(sg_buf_end - sg_bufp));
+			return -EINVAL;
+		}
+		if (copy_from_user(sg_bufp, bp->buffer, bp->length)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid buffer object ptr %p\n",
+				proc->pid, thread->pid, bp->buffer);
+			return -EFAULT;
+		}
+		bp->buffer = sg_bufp + target_proc->user_buffer_offset;
+		sg_bufp += len;
+		*sg_bytes += bp->length;
+		count++;
+	}
+	return count;
+}
+
+/*
+ * A synchronous call made while handling an incoming transaction goes to the
+ * thread of target_proc that is waiting for us, if there is one.
+ */
+static struct binder_thread *
+binder_get_nested_target(struct binder_thread *thread,
+			 struct binder_proc *target_proc)
+{
+	struct binder_transaction *tmp;
+	struct binder_thread *target_thread = NULL;
+
+	for (tmp = thread->transaction_stack; tmp; tmp = tmp->from_parent)
+		if (tmp->from && tmp->from->proc == target_proc)
+			target_thread = tmp->from;
+	return target_thread;
+}
+
 static void
 binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
-	struct binder_transaction_data *tr, int reply)
+	struct binder_transaction_data *tr, int reply,
+	size_t extra_buffers_size)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1272,6 +1685,9 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error;
+	int sg_buffers = 0;
+	size_t sg_bytes = 0;
+	u64 copy_ns = 0;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1290,7 +1706,7 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_priority(&in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1363,11 +1779,8 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
+			target_thread = binder_get_nested_target(thread,
+								 target_proc);
 		}
 	}
 	if (target_thread) {
@@ -1424,33 +1837,105 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	binder_get_priority(current, &t->priority);
+
+	/*
+	 * Pin the target node and proc, then drop binder_lock while the
+	 * buffer is allocated and the payload is copied in.  Both may
+	 * sleep for a long time (page allocation, mmap_sem, page faults
+	 * on the sender's data) and only touch state owned by the target's
+	 * allocator and by this transaction.
+	 */
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	target_proc->tmp_ref++;
+	mutex_unlock(&binder_lock);
+
+	return_error = BR_OK;
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
+	if (t->buffer) {
+		u64 copy_start = binder_now_ns();
+
+		t->buffer->allow_user_free = 0;
+		t->buffer->debug_id = t->debug_id;
+		t->buffer->transaction = t;
+		t->buffer->target_node = target_node;
+
+		if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				   tr->data_size)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid data ptr\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+		} else if (copy_from_user(t->buffer->data +
+					  ALIGN(tr->data_size, sizeof(void *)),
+					  tr->data.ptr.offsets,
+					  tr->offsets_size)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid offsets ptr\n",
+				proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+		} else if (extra_buffers_size) {
+			sg_buffers = binder_copy_sg_buffers(proc, thread,
+					target_proc, t->buffer, &sg_bytes);
+			if (sg_buffers < 0)
+				return_error = BR_FAILED_REPLY;
+		}
+		copy_ns = binder_now_ns() - copy_start;
+	}
+
+	mutex_lock(&binder_lock);
+	if (target_proc->is_dead) {
+		/*
+		 * binder_deferred_release() does not honour our reference on
+		 * target_node, which may be freed by now: leave it alone.
+		 */
+		target_node = NULL;
+		if (t->buffer)
+			t->buffer->target_node = NULL;
+		return_error = BR_DEAD_REPLY;
+	}
 	if (t->buffer == NULL) {
-		return_error = BR_FAILED_REPLY;
+		if (target_node)
+			binder_dec_node(target_node, 1, 0);
+		if (return_error == BR_OK)
+			return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
-
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
-
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
+	if (return_error != BR_OK)
 		goto err_copy_data_failed;
+	if (!reply && !(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
+		/* the thread picked above may have exited meanwhile */
+		target_thread = binder_get_nested_target(thread, target_proc);
+		t->to_thread = target_thread;
+		if (target_thread) {
+			target_list = &target_thread->todo;
+			target_wait = &target_thread->wait;
+		} else {
+			target_list = &target_proc->todo;
+			target_wait = &target_proc->wait;
+		}
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	if (reply) {
+		/* the caller may have exited while the payload was copied */
+		if (in_reply_to->from == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			goto err_dead_target;
+		}
 	}
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
@@ -1483,7 +1968,18 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
+				node->sched_policy = (fp->flags & FLAT_BINDER_FLAG_SCHED_POLICY_MASK) >> FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT;
 				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+				if (binder_is_rt_policy(node->sched_policy) &&
+				    !binder_can_use_rt_priority(node->min_priority)) {
+					binder_user_error("binder: %d:%d node %d "
+						"not allowed min rt priority %d\n",
+						proc->pid, thread->pid,
+						node->debug_id,
+						node->min_priority);
+					node->sched_policy = SCHED_NORMAL;
+					node->min_priority = 0;
+				}
 				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
@@ -1584,6 +2080,29 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_PTR:
+			/*
+			 * Only BC_TRANSACTION_SG and BC_REPLY_SG copy these
+			 * into the extra buffers area; anywhere else the
+			 * object would hand the target a sender address.
+			 */
+			if (!extra_buffers_size) {
+				binder_user_error("binder: %d:%d got buffer "
+					"object without extra buffers\n",
+					proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_object_type;
+			}
+			/* already copied by binder_copy_sg_buffers */
+			if (fp->flags) {
+				binder_user_error("binder: %d:%d got buffer "
+					"object with flags %lx\n",
+					proc->pid, thread->pid, fp->flags);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_object_type;
+			}
+			break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1593,6 +2112,14 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 		}
 	}
 	if (reply) {
+		u64 service_ns = binder_now_ns() - in_reply_to->delivered_ns;
+
+		binder_latency_add(&proc->service_latency, service_ns);
+		if (binder_is_rt_policy(in_reply_to->priority.sched_policy))
+			binder_latency_add(&proc->rt_service_latency,
+					   service_ns);
+		trace_binder_reply(t->debug_id, in_reply_to->debug_id,
+				   service_ns);
 		BUG_ON(t->buffer->async_transaction != 0);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
@@ -1610,11 +2137,30 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			target_node->has_async_transaction = 1;
 	}
 	t->work.type = BINDER_WORK_TRANSACTION;
+	t->queued_ns = binder_now_ns();
 	list_add_tail(&t->work.entry, target_list);
+	trace_binder_transaction(t->debug_id, reply, t->flags, target_proc->pid,
+				 target_thread ? target_thread->pid : 0,
+				 tr->data_size);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	if (sg_buffers) {
+		binder_stats.sg_buffers += sg_buffers;
+		binder_stats.sg_bytes += sg_bytes;
+		proc->stats.sg_buffers += sg_buffers;
+		proc->stats.sg_bytes += sg_bytes;
+		thread->stats.sg_buffers += sg_buffers;
+		thread->stats.sg_bytes += sg_bytes;
+	}
+	binder_stats.copy_bytes += tr->data_size + tr->offsets_size + sg_bytes;
+	binder_stats.copy_ns += copy_ns;
+	proc->stats.copy_bytes += tr->data_size + tr->offsets_size + sg_bytes;
+	proc->stats.copy_ns += copy_ns;
+	thread->stats.copy_bytes += tr->data_size + tr->offsets_size + sg_bytes;
+	thread->stats.copy_ns += copy_ns;
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1625,11 +2171,13 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+err_dead_target:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
 err_alloc_tcomplete_failed:
@@ -1723,6 +2271,9 @@ binder_transaction_buffer_release(struct binder_proc *proc, struct binder_buffer
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR:
+			break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad object type %lx\n", debug_id, fp->type);
 			break;
@@ -1878,20 +2429,26 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim it so a racing BC_FREE_BUFFER cannot free it */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
 			if (binder_debug_mask & BINDER_DEBUG_FREE_BUFFER)
 				printk(KERN_INFO "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				       proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1909,7 +2466,9 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			mutex_unlock(&binder_lock);
 			binder_free_buf(proc, buffer);
+			mutex_lock(&binder_lock);
 			break;
 		}
 
@@ -1920,7 +2479,19 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers_size);
 			break;
 		}
 
@@ -2184,7 +2755,7 @@ retry:
 				proc->pid, thread->pid, thread->looper);
 			wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(&proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2341,15 +2912,20 @@ retry:
 		BUG_ON(t->buffer == NULL);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
+			struct binder_priority node_prio;
+
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
+			node_prio.sched_policy = target_node->sched_policy;
+			node_prio.prio = target_node->min_priority;
+			binder_get_priority(current, &t->saved_priority);
+			if (!(t->flags & TF_ONE_WAY) &&
+			    binder_priority_higher(&t->priority, &node_prio))
+				binder_set_priority(&t->priority);
 			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+				 binder_priority_higher(&node_prio,
+							&t->saved_priority))
+				binder_set_priority(&node_prio);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2391,6 +2967,11 @@ retry:
 			       tr.data.ptr.buffer, tr.data.ptr.offsets);
 
 		list_del(&t->work.entry);
+		t->delivered_ns = binder_now_ns();
+		binder_latency_add(&proc->queue_latency,
+				   t->delivered_ns - t->queued_ns);
+		trace_binder_transaction_received(t->debug_id, proc->pid,
+				thread->pid, t->delivered_ns - t->queued_ns);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
@@ -2711,6 +3292,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2759,6 +3341,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2808,7 +3394,8 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
+	mutex_init(&proc->alloc_lock);
+	binder_get_priority(current, &proc->default_priority);
 	mutex_lock(&binder_lock);
 	binder_stats.obj_created[BINDER_STAT_PROC]++;
 	hlist_add_head(&proc->proc_node, &binder_procs);
@@ -2871,9 +3458,8 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -2935,8 +3521,29 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
-	buffers = 0;
 
+	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
+		printk(KERN_INFO "binder_release: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d\n",
+		       proc->pid, threads, nodes, incoming_refs, outgoing_refs, active_transactions);
+
+	/*
+	 * Senders that are copying into our buffer hold a tmp_ref; the last
+	 * of them tears down the allocator once it has freed its buffer.
+	 */
+	proc->is_dead = 1;
+	if (proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(!proc->is_dead || proc->tmp_ref);
+
+	buffers = 0;
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer, rb_node);
 		t = buffer->transaction;
@@ -2955,14 +3562,17 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+		mutex_lock(&proc->alloc_lock);
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
+			if (proc->pages[i].page_ptr) {
+				if (!binder_lru_del(proc, &proc->pages[i]) &&
+				    (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC))
 					printk(KERN_INFO "binder_release: %d: page %d at %p not freed\n", proc->pid, i, proc->buffer + i * PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
+		mutex_unlock(&proc->alloc_lock);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -2970,8 +3580,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 	put_task_struct(proc->tsk);
 
 	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
-		printk(KERN_INFO "binder_release: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d, buffers %d, pages %d\n",
-		       proc->pid, threads, nodes, incoming_refs, outgoing_refs, active_transactions, buffers, page_count);
+		printk(KERN_INFO "binder_release: %d buffers %d, pages %d\n",
+		       proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
@@ -3029,12 +3639,13 @@ static void binder_defer_work(struct binder_proc *proc, int defer)
 
 static char *print_binder_transaction(char *buf, char *end, const char *prefix, struct binder_transaction *t)
 {
-	buf += snprintf(buf, end - buf, "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+	buf += snprintf(buf, end - buf, "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 			prefix, t->debug_id, t, t->from ? t->from->proc->pid : 0,
 			t->from ? t->from->pid : 0,
 			t->to_proc ? t->to_proc->pid : 0,
 			t->to_thread ? t->to_thread->pid : 0,
-			t->code, t->flags, t->priority, t->need_reply);
+			t->code, t->flags, t->priority.sched_policy,
+			t->priority.prio, t->need_reply);
 	if (buf >= end)
 		return buf;
 	if (t->buffer == NULL) {
@@ -3202,8 +3813,10 @@ static char *print_binder_proc(char *buf, char *end, struct binder_proc *proc, i
 		for (n = rb_first(&proc->refs_by_desc); n != NULL && buf < end; n = rb_next(n))
 			buf = print_binder_ref(buf, end, rb_entry(n, struct binder_ref, rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL && buf < end; n = rb_next(n))
 		buf = print_binder_buffer(buf, end, "  buffer", rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		if (buf >= end)
 			break;
@@ -3259,7 +3872,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3305,6 +3920,14 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix, struct
 		if (buf >= end)
 			return buf;
 	}
+
+	if (stats->sg_buffers)
+		buf += snprintf(buf, end - buf, "%ssg buffers: %d bytes %zd\n",
+				prefix, stats->sg_buffers, stats->sg_bytes);
+	if (stats->copy_bytes)
+		buf += snprintf(buf, end - buf, "%scopied: bytes %zd ns %llu\n",
+				prefix, stats->copy_bytes,
+				(unsigned long long)stats->copy_ns);
 	return buf;
 }
 
@@ -3312,7 +3935,8 @@ static char *print_binder_proc_stats(char *buf, char *end, struct binder_proc *p
 {
 	struct binder_work *w;
 	struct rb_node *n;
-	int count, strong, weak;
+	int count, strong, weak, free_count;
+	size_t free_size, largest_free;
 
 	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
 	if (buf >= end)
@@ -3350,9 +3974,30 @@ static char *print_binder_proc_stats(char *buf, char *end, struct binder_proc *p
 		return buf;
 
 	count = 0;
+	free_count = 0;
+	free_size = 0;
+	largest_free = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
-	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
+	for (n = rb_first(&proc->free_buffers); n != NULL; n = rb_next(n)) {
+		size_t size = binder_buffer_size(proc,
+				rb_entry(n, struct binder_buffer, rb_node));
+		free_count++;
+		free_size += size;
+		if (size > largest_free)
+			largest_free = size;
+	}
+	buf += snprintf(buf, end - buf, "  buffers: %d\n"
+			"  buffer space: used %zd high %zd of %zd\n"
+			"  free space: %zd in %d chunks, largest %zd\n"
+			"  pages: mapped %d high %d cached %d\n"
+			"  page cache: hits %d reclaimed %d\n",
+			count, proc->buffer_used, proc->buffer_used_high,
+			proc->buffer_size, free_size, free_count, largest_free,
+			proc->pages_mapped, proc->pages_high, proc->pages_lru,
+			proc->page_cache_hits, proc->page_cache_reclaimed);
+	mutex_unlock(&proc->alloc_lock);
 	if (buf >= end)
 		return buf;
 
@@ -3442,6 +4087,8 @@ static int binder_read_proc_stats(
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
 	p = print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
+	p += snprintf(p, page + PAGE_SIZE - p, "cached pages: %d\n",
+		      binder_lru_pages);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (p >= page + PAGE_SIZE)
@@ -3533,6 +4180,82 @@ static int binder_read_proc_proc(
 	return len < count ? len  : count;
 }
 
+static char *print_binder_latency_hist(char *buf, char *end,
+	const char *name, struct binder_latency_hist *hist)
+{
+	int i;
+	u64 avg;
+
+	if (!hist->count)
+		return buf;
+	avg = hist->total_us;
+	do_div(avg, hist->count);
+	buf += snprintf(buf, end - buf, "  %s: %u samples, avg %lluus\n",
+			name, hist->count, (unsigned long long)avg);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		if (buf >= end)
+			break;
+		if (!hist->bucket[i])
+			continue;
+		if (i == 0)
+			buf += snprintf(buf, end - buf, "    <1us: %u\n",
+					hist->bucket[i]);
+		else if (i == BINDER_LATENCY_BUCKETS - 1)
+			buf += snprintf(buf, end - buf, "    >=%uus: %u\n",
+					1U << (i - 1), hist->bucket[i]);
+		else
+			buf += snprintf(buf, end - buf, "    <%uus: %u\n",
+					1U << i, hist->bucket[i]);
+	}
+	return buf;
+}
+
+static int binder_read_proc_latency(
+	char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int len = 0;
+	char *buf = page;
+	char *end = page + PAGE_SIZE;
+	int do_lock = !binder_debug_no_lock;
+
+	if (off)
+		return 0;
+
+	if (do_lock)
+		mutex_lock(&binder_lock);
+
+	buf += snprintf(buf, end - buf, "binder latency:\n");
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (buf >= end)
+			break;
+		if (!proc->queue_latency.count && !proc->service_latency.count)
+			continue;
+		buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
+		buf = print_binder_latency_hist(buf, end, "queue",
+						&proc->queue_latency);
+		buf = print_binder_latency_hist(buf, end, "service",
+						&proc->service_latency);
+		buf = print_binder_latency_hist(buf, end, "service_rt",
+						&proc->rt_service_latency);
+	}
+	if (do_lock)
+		mutex_unlock(&binder_lock);
+	if (buf > page + PAGE_SIZE)
+		buf = page + PAGE_SIZE;
+
+	*start = page + off;
+
+	len = buf - page;
+	if (len > off)
+		len -= off;
+	else
+		len = 0;
+
+	return len < count ? len  : count;
+}
+
 static char *print_binder_transaction_log_entry(char *buf, char *end, struct binder_transaction_log_entry *e)
 {
 	buf += snprintf(buf, end - buf, "%d: %s from %d:%d to %d:%d node %d handle %d size %d:%d\n",
@@ -3603,10 +4326,12 @@ static int __init binder_init(void)
 	if (binder_proc_dir_entry_root)
 		binder_proc_dir_entry_proc = proc_mkdir("proc", binder_proc_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_proc_dir_entry_root) {
 		create_proc_read_entry("state", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_state, NULL);
 		create_proc_read_entry("stats", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_stats, NULL);
 		create_proc_read_entry("transactions", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_transactions, NULL);
+		create_proc_read_entry("latency", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_latency, NULL);
 		create_proc_read_entry("transaction_log", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_transaction_log, &binder_transaction_log);
 		create_proc_read_entry("failed_transaction_log", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_transaction_log, &binder_transaction_log_failed);
 	}
@@ -32,11 +32,20 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy (SCHED_NORMAL, SCHED_FIFO, SCHED_RR or
+	 * SCHED_BATCH) of the minimum priority a node is serviced at.  The
+	 * priority bits hold a nice value for SCHED_NORMAL and SCHED_BATCH
+	 * and an rt_priority for SCHED_FIFO and SCHED_RR.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
 };
 
 /*
@@ -61,6 +70,21 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A buffer object describes an additional block of memory that is sent
+ * along with a BC_TRANSACTION_SG or BC_REPLY_SG.  It occupies the same
+ * space as a flat_binder_object in the data.  The driver copies the block
+ * straight from the sender into the extra buffers area of the target's
+ * transaction buffer and rewrites 'buffer' to point at the copy in the
+ * target's address space.
+ */
+struct binder_buffer_object {
+	unsigned long		type;		/* BINDER_TYPE_PTR */
+	unsigned long		flags;		/* must be 0 */
+	void			*buffer;
+	size_t			length;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +171,11 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	size_t		buffers_size;	/* total size of all buffer objects */
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +353,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with room for
+	 * buffers_size bytes of binder_buffer_object payloads.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
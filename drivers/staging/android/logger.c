@@ -23,40 +23,105 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * Compressed logs batch entries into an uncompressed "open" segment of up to
+ * LOGGER_CHUNK_SIZE bytes. When it fills, the segment is sealed and a fresh
+ * one opened; the writer that sealed it then LZO compresses it outside of the
+ * log lock and appends it to the ring as one chunk. So the ring holds a run
+ * of chunks, followed by the sealed segment, if any, and the open segment.
+ */
+#define LOGGER_CHUNK_SIZE	(16*1024)
+#define LOGGER_CHUNK_RAW	0x1	/* chunk did not compress, stored as is */
+
+/* bounds for LOGGER_SET_LOG_BUF_SIZE */
+#define LOGGER_MIN_LOG_SIZE	(4*LOGGER_CHUNK_SIZE)
+#define LOGGER_MAX_LOG_SIZE	(16*1024*1024)
+
+/* header of a chunk in a compressed log's ring */
+struct logger_chunk {
+	__u16	clen;	/* stored length of the data that follows */
+	__u16	ulen;	/* uncompressed length */
+	__u16	nr;	/* number of entries */
+	__u16	flags;	/* LOGGER_CHUNK_* */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock', which is only ever held to move bytes between the ring and
+ * kernel memory: user copies happen outside of it. 'size', 'buffer' and the
+ * compression buffers only change with logger_config_mutex also held.
+ * 'seal_mutex' is held while packing the sealed segment, which is then read
+ * without log->lock; 'sealed', 'cbuf' and 'wrkmem' don't change under it.
  */
 struct logger_log {
 	unsigned char *		buffer;	/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	int			vmalloced; /* buffer was resized at runtime */
+	int			compressed; /* ring holds LZO chunks */
+	unsigned char *		open;	/* compressed: the open segment */
+	size_t			open_len; /* bytes in the open segment */
+	unsigned int		open_nr; /* entries in the open segment */
+	unsigned char *		sealed;	/* compressed: full segment to pack */
+	size_t			sealed_len; /* bytes in the sealed segment */
+	unsigned int		sealed_nr; /* entries in the sealed segment */
+	struct mutex		seal_mutex; /* serializes packing 'sealed' */
+	unsigned char *		cbuf;	/* compressed: compressor output */
+	void *			wrkmem;	/* compressed: compressor workspace */
+	struct logger_stats	stats;
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. 'r_off' and the fields after it are protected by
+ * log->lock, since writers pull lapped readers forward; 'mutex' serializes
+ * readers sharing the bounce and chunk buffers.
  */
 struct logger_reader {
 	struct logger_log *	log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
+	struct mutex		mutex;	/* serializes read() on this reader */
+	unsigned char *		bounce;	/* entry staged for copy_to_user */
+	unsigned char *		chunk;	/* compressed: current chunk, unpacked */
+	unsigned char *		cbuf;	/* compressed: current chunk, packed */
 	size_t			r_off;	/* current read head offset */
+	size_t			r_pos;	/* compressed: offset into the chunk */
+	size_t			chunk_len; /* unpacked length of 'chunk' */
+	size_t			chunk_rec; /* ring length of the current chunk */
+	int			cached;	/* 'chunk' holds the chunk at r_off */
+	unsigned int		laps;	/* times the reader was moved by others */
 };
 
+/*
+ * Per-cpu staging buffers for writers. The payload is copied from user space
+ * into the local cpu's buffer with page faults disabled, so that the log lock
+ * is only held for the memcpy into the ring. If the copy would fault we fall
+ * back to a kmalloc()ed buffer and a sleeping copy.
+ */
+static DEFINE_PER_CPU(unsigned char *, logger_stage);
+
+/* serializes LOGGER_SET_LOG_BUF_SIZE and LOGGER_SET_COMPRESSION */
+static DEFINE_MUTEX(logger_config_mutex);
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -87,7 +152,7 @@ static inline struct logger_log * file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -106,38 +171,197 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * ring_read - copies 'count' bytes starting at 'off' out of the ring
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void ring_read(struct logger_log *log, size_t off, void *buf,
+		      size_t count)
 {
 	size_t len;
 
-	/*
-	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * get_record_len - Grabs the length of the record in the ring at 'off': an
+ * entry for plain logs, a chunk for compressed ones.
+ *
+ * Caller needs to hold log->lock.
+ */
+static size_t get_record_len(struct logger_log *log, size_t off)
+{
+	struct logger_chunk chunk;
+
+	if (!log->compressed)
+		return get_entry_len(log, off);
+
+	ring_read(log, off, &chunk, sizeof(struct logger_chunk));
+	return sizeof(struct logger_chunk) + chunk.clen;
+}
+
+/*
+ * tail_len - returns the length of the unpacked tail of a compressed log: the
+ * sealed segment, if any, followed by the open segment. Readers that caught
+ * up with the writer index into it with r_pos.
+ *
+ * Caller needs to hold log->lock.
+ */
+static inline size_t tail_len(struct logger_log *log)
+{
+	return log->sealed_len + log->open_len;
+}
+
+/*
+ * tail_entry - returns the entry at 'pos' in the unpacked tail of 'log'
+ *
+ * Caller needs to hold log->lock.
+ */
+static inline unsigned char *tail_entry(struct logger_log *log, size_t pos)
+{
+	if (pos < log->sealed_len)
+		return log->sealed + pos;
+	return log->open + (pos - log->sealed_len);
+}
 
+/*
+ * logger_readable - does 'reader' have anything left to read?
+ *
+ * Caller needs to hold log->lock.
+ */
+static inline int logger_readable(struct logger_log *log,
+				  struct logger_reader *reader)
+{
+	return log->w_off != reader->r_off || reader->r_pos < tail_len(log);
+}
+
+/*
+ * do_read_log - reads exactly 'count' bytes from 'log' into the reader's
+ * bounce buffer.
+ *
+ * Caller must hold log->lock.
+ */
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			size_t count)
+{
+	ring_read(log, reader->r_off, reader->bounce, count);
 	reader->r_off = logger_offset(reader->r_off + count);
+}
+
+/*
+ * do_read_compressed - stages the reader's next entry from a compressed log
+ * in its bounce buffer. Returns the entry's length, zero if there is nothing
+ * to read, or a negative error code.
+ *
+ * Caller must hold log->lock, which is dropped while unpacking a chunk.
+ */
+static ssize_t do_read_compressed(struct logger_log *log,
+				  struct logger_reader *reader, size_t count)
+{
+	struct logger_chunk chunk;
+	const unsigned char *entry;
+	size_t ulen, len;
+	unsigned int laps;
+	int ret;
+
+	while (1) {
+		if (reader->r_off == log->w_off) {
+			/* caught up with the writer: read the unpacked tail */
+			if (reader->r_pos >= tail_len(log))
+				return 0;
+			entry = tail_entry(log, reader->r_pos);
+		} else if (reader->cached) {
+			if (reader->r_pos >= reader->chunk_len) {
+				/* done with this chunk, move on to the next */
+				reader->r_off = logger_offset(reader->r_off +
+							reader->chunk_rec);
+				reader->r_pos = 0;
+				reader->cached = 0;
+				continue;
+			}
+			entry = reader->chunk + reader->r_pos;
+		} else {
+			ring_read(log, reader->r_off, &chunk,
+				  sizeof(struct logger_chunk));
+			if (unlikely(chunk.clen > LOGGER_CHUNK_SIZE)) {
+				/* can't trust its length to find the next one */
+				printk(KERN_ERR "logger: bad chunk in log '%s'\n",
+				       log->misc.name);
+				reader->r_off = log->w_off;
+				reader->r_pos = 0;
+				continue;
+			}
+			ring_read(log, logger_offset(reader->r_off +
+						     sizeof(struct logger_chunk)),
+				  reader->cbuf, chunk.clen);
+			laps = reader->laps;
+			spin_unlock(&log->lock);
+
+			if (chunk.flags & LOGGER_CHUNK_RAW) {
+				memcpy(reader->chunk, reader->cbuf, chunk.clen);
+				ulen = chunk.clen;
+				ret = LZO_E_OK;
+			} else {
+				ulen = LOGGER_CHUNK_SIZE;
+				ret = lzo1x_decompress_safe(reader->cbuf,
+						chunk.clen, reader->chunk, &ulen);
+			}
+
+			spin_lock(&log->lock);
+			/* no longer compressed? let logger_read() start over */
+			if (unlikely(!log->compressed))
+				return 0;
+			/* lapped while unpacking? start over from the new spot */
+			if (reader->laps != laps)
+				continue;
+			reader->chunk_rec = sizeof(struct logger_chunk) +
+					    chunk.clen;
+			if (unlikely(ret != LZO_E_OK || ulen != chunk.ulen)) {
+				printk(KERN_ERR "logger: bad chunk in log '%s'\n",
+				       log->misc.name);
+				ulen = 0;
+			}
+			reader->chunk_len = ulen;
+			reader->cached = 1;
+			continue;
+		}
 
-	return count;
+		len = sizeof(struct logger_entry) +
+		      ((struct logger_entry *) entry)->len;
+		if (count < len)
+			return -EINVAL;
+
+		memcpy(reader->bounce, entry, len);
+		reader->r_pos += len;
+
+		return len;
+	}
+}
+
+/*
+ * alloc_reader_chunks - allocates the buffers a reader needs to unpack the
+ * chunks of a compressed log.
+ */
+static int alloc_reader_chunks(struct logger_reader *reader)
+{
+	if (reader->chunk)
+		return 0;
+
+	reader->cbuf = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	reader->chunk = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	if (!reader->cbuf || !reader->chunk) {
+		kfree(reader->cbuf);
+		kfree(reader->chunk);
+		reader->cbuf = NULL;
+		reader->chunk = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
 }
 
 /*
@@ -164,9 +388,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = !logger_readable(log, reader);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -187,42 +411,67 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	if (log->compressed) {
+		ret = alloc_reader_chunks(reader);
+		if (ret)
+			goto out;
+	}
+
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(!logger_readable(log, reader) ||
+		     (log->compressed && !reader->chunk))) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+	if (log->compressed) {
+		ret = do_read_compressed(log, reader, count);
+		spin_unlock(&log->lock);
+		if (!ret) {
+			mutex_unlock(&reader->mutex);
+			goto start;
+		}
+		if (ret < 0)
+			goto out;
+	} else {
+		/* get the size of the next entry */
+		ret = get_entry_len(log, reader->r_off);
+		if (count < ret) {
+			spin_unlock(&log->lock);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		/* get exactly one entry from the log */
+		do_read_log(log, reader, ret);
+		spin_unlock(&log->lock);
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (copy_to_user(buf, reader->bounce, ret))
+		ret = -EFAULT;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
+ * get_next_entry - return the offset of the first valid record at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
 	size_t count = 0;
 
 	do {
-		size_t nr = get_entry_len(log, off);
+		size_t nr = get_record_len(log, off);
 		off = logger_offset(off + nr);
 		count += nr;
 	} while (count < len);
@@ -230,6 +479,34 @@ static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 	return off;
 }
 
+/*
+ * drop_head - pulls the start head forward past at least 'len' bytes,
+ * accounting for the entries that fall off the end of the log.
+ *
+ * Caller must hold log->lock.
+ */
+static void drop_head(struct logger_log *log, size_t len)
+{
+	struct logger_chunk chunk;
+	size_t count = 0;
+
+	do {
+		size_t nr = get_record_len(log, log->head);
+
+		if (log->compressed) {
+			ring_read(log, log->head, &chunk,
+				  sizeof(struct logger_chunk));
+			log->stats.entries_dropped += chunk.nr;
+			log->stats.bytes_dropped += chunk.ulen;
+		} else {
+			log->stats.entries_dropped++;
+			log->stats.bytes_dropped += nr;
+		}
+		log->head = logger_offset(log->head + nr);
+		count += nr;
+	} while (count < len);
+}
+
 /*
  * clock_interval - is a < c < b in mod-space? Put another way, does the line
  * from a to b cross c?
@@ -251,9 +528,9 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * record after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -262,17 +539,39 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	struct logger_reader *reader;
 
 	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+		drop_head(log, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (clock_interval(old, new, reader->r_off)) {
 			reader->r_off = get_next_entry(log, reader->r_off, len);
+			reader->r_pos = 0;
+			reader->cached = 0;
+			reader->laps++;
+		}
+}
+
+/*
+ * reset_readers - points all readers and the start head at 'off'
+ *
+ * The caller needs to hold log->lock.
+ */
+static void reset_readers(struct logger_log *log, size_t off)
+{
+	struct logger_reader *reader;
+
+	list_for_each_entry(reader, &log->readers, list) {
+		reader->r_off = off;
+		reader->r_pos = 0;
+		reader->cached = 0;
+		reader->laps++;
+	}
+	log->head = off;
 }
 
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -289,92 +588,296 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * pack_sealed_segment - compresses the sealed segment of a compressed log and
+ * appends it to the ring as a chunk.
  *
- * The caller needs to hold log->mutex.
+ * The compression runs without log->lock, so writers keep filling the open
+ * segment and readers keep reading the sealed one meanwhile; the lock is only
+ * taken to publish the chunk. Must be called from process context.
+ */
+static void pack_sealed_segment(struct logger_log *log)
+{
+	struct logger_chunk chunk;
+	struct logger_reader *reader;
+	const unsigned char *data;
+	size_t clen = lzo1x_worst_compress(LOGGER_CHUNK_SIZE);
+	size_t old;
+	int ret;
+
+	mutex_lock(&log->seal_mutex);
+
+	/* someone may have packed it while we waited */
+	spin_lock(&log->lock);
+	chunk.ulen = log->sealed_len;
+	chunk.nr = log->sealed_nr;
+	spin_unlock(&log->lock);
+	if (!chunk.ulen)
+		goto out;
+
+	ret = lzo1x_1_compress(log->sealed, chunk.ulen, log->cbuf, &clen,
+			       log->wrkmem);
+	data = log->cbuf;
+	chunk.flags = 0;
+	if (ret != LZO_E_OK || clen >= chunk.ulen) {
+		data = log->sealed;
+		clen = chunk.ulen;
+		chunk.flags = LOGGER_CHUNK_RAW;
+	}
+	chunk.clen = clen;
+
+	spin_lock(&log->lock);
+	old = log->w_off;
+
+	fix_up_readers(log, sizeof(struct logger_chunk) + clen);
+
+	do_write_log(log, &chunk, sizeof(struct logger_chunk));
+	do_write_log(log, data, clen);
+	log->stats.bytes_stored += sizeof(struct logger_chunk) + clen;
+
+	/*
+	 * Readers inside the sealed segment now sit in the chunk at 'old', at
+	 * the same position. Those past it carry on in the open segment, which
+	 * is all that is left of the tail.
+	 */
+	list_for_each_entry(reader, &log->readers, list)
+		if (reader->r_off == old && reader->r_pos >= chunk.ulen) {
+			reader->r_off = log->w_off;
+			reader->r_pos -= chunk.ulen;
+		}
+
+	log->sealed_len = 0;
+	log->sealed_nr = 0;
+	spin_unlock(&log->lock);
+
+out:
+	mutex_unlock(&log->seal_mutex);
+}
+
+/*
+ * copy_payload_from_user - gathers 'len' bytes of payload from the vector
+ * 'iov' into 'dst'. With 'atomic' set the copy is done with page faults
+ * disabled and fails rather than sleeping.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_payload_from_user(unsigned char *dst, const struct iovec *iov,
+				  unsigned long nr_segs, size_t len, int atomic)
 {
-	size_t len;
+	size_t done = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0 && done < len) {
+		size_t nr = min_t(size_t, iov->iov_len, len - done);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, nr) ||
+			    __copy_from_user_inatomic(dst + done,
+						      iov->iov_base, nr))
+				return -EFAULT;
+		} else if (copy_from_user(dst + done, iov->iov_base, nr))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		done += nr;
+		iov++;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
- * logger_aio_write - our write method, implementing support for write(),
- * writev(), and aio_write(). Writes are our fast path, and we try to optimize
- * them above all else.
+ * logger_commit - appends one entry with the given payload to 'log'
+ *
+ * The header is stamped under log->lock, so entries land in the ring in
+ * timestamp order no matter which cpu staged them.
+ *
+ * Returns zero on success, or one if the entry sealed the open segment of a
+ * compressed log and the caller must pack_sealed_segment() once it can sleep.
+ * Returns -EBUSY, without writing the entry, if the open segment is full but
+ * the last sealed one has not been packed yet.
  */
-ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
-			 unsigned long nr_segs, loff_t ppos)
+static int logger_commit(struct logger_log *log, const void *payload,
+			 size_t len)
 {
-	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	size_t total = sizeof(struct logger_entry) + len;
+	int ret = 0;
 
 	header.pid = current->tgid;
 	header.tid = current->pid;
+	header.len = len;
+
+	if (!spin_trylock(&log->lock)) {
+		spin_lock(&log->lock);
+		log->stats.writes_contended++;
+	}
+
+	now = current_kernel_time();
 	header.sec = now.tv_sec;
 	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+
+	if (log->compressed) {
+		if (log->open_len + total > LOGGER_CHUNK_SIZE) {
+			if (log->sealed_len) {
+				spin_unlock(&log->lock);
+				return -EBUSY;
+			}
+			swap(log->open, log->sealed);
+			log->sealed_len = log->open_len;
+			log->sealed_nr = log->open_nr;
+			log->open_len = 0;
+			log->open_nr = 0;
+			ret = 1;
+		}
+		memcpy(log->open + log->open_len, &header,
+		       sizeof(struct logger_entry));
+		memcpy(log->open + log->open_len + sizeof(struct logger_entry),
+		       payload, len);
+		log->open_len += total;
+		log->open_nr++;
+	} else {
+		/*
+		 * Fix up any readers, pulling them forward to the first
+		 * readable entry after (what will be) the new write offset.
+		 */
+		fix_up_readers(log, total);
+
+		do_write_log(log, &header, sizeof(struct logger_entry));
+		do_write_log(log, payload, len);
+		log->stats.bytes_stored += total;
+	}
+	log->stats.bytes_written += total;
+	log->stats.entries_written++;
+
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+/*
+ * logger_aio_write - our write method, implementing support for write(),
+ * writev(), and aio_write(). Writes are our fast path, and we try to optimize
+ * them above all else.
+ */
+ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			 unsigned long nr_segs, loff_t ppos)
+{
+	struct logger_log *log = file_get_log(iocb->ki_filp);
+	size_t len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	unsigned char *payload;
+	int ret;
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	payload = get_cpu_var(logger_stage);
+	pagefault_disable();
+	ret = copy_payload_from_user(payload, iov, nr_segs, len, 1);
+	pagefault_enable();
+	if (likely(!ret))
+		ret = logger_commit(log, payload, len);
+	put_cpu_var(logger_stage);
+
+	if (unlikely(ret < 0)) {
+		/*
+		 * The payload is not resident, or the log is still packing its
+		 * last segment; take the slow path.
+		 */
+		spin_lock(&log->lock);
+		log->stats.writes_slow++;
+		spin_unlock(&log->lock);
+		payload = kmalloc(len, GFP_KERNEL);
+		if (!payload)
+			return -ENOMEM;
+		ret = copy_payload_from_user(payload, iov, nr_segs, len, 0);
+		if (!ret)
+			while ((ret = logger_commit(log, payload, len)) < 0)
+				pack_sealed_segment(log);
+		kfree(payload);
+		if (ret < 0)
+			return ret;
+	}
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	if (ret)
+		pack_sealed_segment(log);
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	/* wake up any blocked readers */
+	wake_up_interruptible(&log->wq);
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+	return len;
+}
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+/*
+ * logger_reconfigure - switches 'log' to a ring of 'size' bytes, compressed
+ * or not. The contents of the log are discarded and all readers start over.
+ */
+static long logger_reconfigure(struct logger_log *log, size_t size,
+			       int compressed)
+{
+	unsigned char *buffer = NULL;
+	unsigned char *open = NULL;
+	unsigned char *sealed = NULL;
+	unsigned char *cbuf = NULL;
+	void *wrkmem = NULL;
+	long ret = 0;
+
+	mutex_lock(&logger_config_mutex);
+
+	if (size != log->size) {
+		buffer = vmalloc(size);
+		if (!buffer) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	if (compressed && !log->compressed) {
+		open = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		sealed = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		cbuf = kmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE),
+			       GFP_KERNEL);
+		wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		if (!open || !sealed || !cbuf || !wrkmem) {
+			ret = -ENOMEM;
+			goto out;
 		}
-
-		iov++;
-		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	/* not while a sealed segment is being packed */
+	mutex_lock(&log->seal_mutex);
+	spin_lock(&log->lock);
+	if (buffer) {
+		swap(log->buffer, buffer);
+		if (!log->vmalloced)
+			buffer = NULL;	/* the static one */
+		log->vmalloced = 1;
+		log->size = size;
+	}
+	if (compressed != log->compressed) {
+		swap(log->open, open);
+		swap(log->sealed, sealed);
+		swap(log->cbuf, cbuf);
+		swap(log->wrkmem, wrkmem);
+		log->compressed = compressed;
+	}
+	log->w_off = 0;
+	log->open_len = 0;
+	log->open_nr = 0;
+	log->sealed_len = 0;
+	log->sealed_nr = 0;
+	reset_readers(log, 0);
+	spin_unlock(&log->lock);
+	mutex_unlock(&log->seal_mutex);
+
+	printk(KERN_INFO "logger: log '%s' is now %luK%s\n", log->misc.name,
+	       (unsigned long) size >> 10, compressed ? ", compressed" : "");
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+out:
+	mutex_unlock(&logger_config_mutex);
+	vfree(buffer);
+	kfree(open);
+	kfree(sealed);
+	kfree(cbuf);
+	vfree(wrkmem);
 
 	return ret;
 }
@@ -402,17 +905,24 @@ static int logger_open(struct inode *inode, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader;
 
-		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
+		reader = kzalloc(sizeof(struct logger_reader), GFP_KERNEL);
 		if (!reader)
 			return -ENOMEM;
 
+		reader->bounce = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->bounce) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
+		mutex_init(&reader->mutex);
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -430,7 +940,14 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		kfree(reader->chunk);
+		kfree(reader->cbuf);
+		kfree(reader->bounce);
 		kfree(reader);
 	}
 
@@ -460,21 +977,78 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (logger_readable(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_set_ioctl - handles the ioctls that reconfigure a log, which need
+ * to allocate memory and so can't run under log->lock.
+ */
+static long logger_set_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct logger_log *log = file_get_log(file);
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	switch (cmd) {
+	case LOGGER_SET_LOG_BUF_SIZE:
+		if (!is_power_of_2(arg) || arg < LOGGER_MIN_LOG_SIZE ||
+		    arg > LOGGER_MAX_LOG_SIZE)
+			return -EINVAL;
+		return logger_reconfigure(log, arg, log->compressed);
+	case LOGGER_SET_COMPRESSION:
+		if (log->size < LOGGER_MIN_LOG_SIZE)
+			return -EINVAL;
+		return logger_reconfigure(log, log->size, !!arg);
+	}
+
+	return -ENOTTY;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_stats stats;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	switch (cmd) {
+	case LOGGER_SET_LOG_BUF_SIZE:
+	case LOGGER_SET_COMPRESSION:
+		return logger_set_ioctl(file, cmd, arg);
+	case LOGGER_GET_STATS:
+		spin_lock(&log->lock);
+		stats = log->stats;
+		spin_unlock(&log->lock);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	case LOGGER_FLUSH_LOG:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		/* not while a sealed segment is being packed */
+		mutex_lock(&log->seal_mutex);
+		spin_lock(&log->lock);
+		log->open_len = 0;
+		log->open_nr = 0;
+		log->sealed_len = 0;
+		log->sealed_nr = 0;
+		reset_readers(log, log->w_off);
+		spin_unlock(&log->lock);
+		mutex_unlock(&log->seal_mutex);
+		return 0;
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -485,11 +1059,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
+		/* in compressed logs, counts chunks at their packed size */
 		reader = file->private_data;
 		if (log->w_off >= reader->r_off)
 			ret = log->w_off - reader->r_off;
 		else
 			ret = (log->size - reader->r_off) + log->w_off;
+		ret += tail_len(log);
+		if (log->w_off == reader->r_off)
+			ret -= reader->r_pos;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -497,24 +1075,22 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		if (!logger_readable(log, reader))
+			ret = 0;
+		else if (!log->compressed)
 			ret = get_entry_len(log, reader->r_off);
+		else if (log->w_off == reader->r_off)
+			ret = sizeof(struct logger_entry) + ((struct logger_entry *)
+				tail_entry(log, reader->r_pos))->len;
+		else if (reader->cached && reader->r_pos < reader->chunk_len)
+			ret = sizeof(struct logger_entry) + ((struct logger_entry *)
+				(reader->chunk + reader->r_pos))->len;
 		else
-			ret = 0;
-		break;
-	case LOGGER_FLUSH_LOG:
-		if (!(file->f_mode & FMODE_WRITE)) {
-			ret = -EBADF;
-			break;
-		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
-		ret = 0;
+			ret = LOGGER_ENTRY_MAX_LEN; /* still packed; upper bound */
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -547,7 +1123,8 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.seal_mutex = __MUTEX_INITIALIZER(VAR .seal_mutex), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -588,6 +1165,14 @@ static int __init init_log(struct logger_log *log)
 static int __init logger_init(void)
 {
 	int ret;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(logger_stage, cpu) = kmalloc(LOGGER_ENTRY_MAX_PAYLOAD,
+						     GFP_KERNEL);
+		if (!per_cpu(logger_stage, cpu))
+			goto out_free_stage;
+	}
 
 	ret = init_log(&log_main);
 	if (unlikely(ret))
@@ -603,5 +1188,12 @@ static int __init logger_init(void)
 
 out:
 	return ret;
+
+out_free_stage:
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(logger_stage, cpu));
+		per_cpu(logger_stage, cpu) = NULL;
+	}
+	return -ENOMEM;
 }
 device_initcall(logger_init);
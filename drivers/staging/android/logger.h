@@ -30,6 +30,20 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_stats - counters returned by LOGGER_GET_STATS. 'bytes_written'
+ * over 'bytes_stored' gives the compression ratio of a compressed log.
+ */
+struct logger_stats {
+	__u64		bytes_written;	/* entry bytes accepted from writers */
+	__u64		bytes_stored;	/* bytes those took up in the ring */
+	__u64		bytes_dropped;	/* entry bytes overwritten by the writer */
+	__u32		entries_written; /* entries accepted from writers */
+	__u32		entries_dropped; /* entries overwritten by the writer */
+	__u32		writes_contended; /* writes that found the lock held */
+	__u32		writes_slow;	/* writes that fell back to kmalloc */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_MAIN		"log_main"	/* everything else */
@@ -44,5 +58,8 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_LOG_BUF_SIZE		_IO(__LOGGERIO, 5) /* resize log */
+#define LOGGER_SET_COMPRESSION		_IO(__LOGGERIO, 6) /* LZO on/off */
+#define LOGGER_GET_STATS		_IOR(__LOGGERIO, 7, struct logger_stats)
 
 #endif /* _LINUX_LOGGER_H */
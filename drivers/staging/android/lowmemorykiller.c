@@ -18,6 +18,18 @@
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <trace/lowmemorykiller.h>
+
+DEFINE_TRACE(lowmem_kill);
+DEFINE_TRACE(lowmem_reaped);
 
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask);
 
@@ -48,18 +60,501 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size, S_IRUGO | S_IWU
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size, S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+/*
+ * Pressure notification: /dev/mem_pressure reports a pressure level, so
+ * userspace can shed caches before we have to kill anything. It is the higher
+ * of two levels:
+ *
+ * 	- free memory: level i is entered once both free and file pages drop
+ * 	  below notify_pct[i] percent of the largest minfree.
+ * 	- reclaim efficiency: level i is entered when, over the last
+ * 	  notify_interval_ms, vmscan scanned at least notify_min_scan pages
+ * 	  and reclaimed fewer than notify_reclaim_pct[i] percent of them.
+ *
+ * The level is recomputed whenever the shrinker runs or the device is read or
+ * polled, and every notify_interval_ms while reclaim is running or the level
+ * is above "none", so waiters also see it drop back once memory recovers.
+ *
+ * The first read() after open returns the current level as text. Later reads
+ * block until the level changes, or fail with EAGAIN under O_NONBLOCK; read()
+ * never returns EOF. poll() is readable exactly when read() would not block.
+ */
+enum {
+	LOWMEM_LEVEL_NONE,
+	LOWMEM_LEVEL_LOW,
+	LOWMEM_LEVEL_MEDIUM,
+	LOWMEM_LEVEL_CRITICAL,
+	LOWMEM_NR_LEVELS
+};
+
+static const char *lowmem_level_names[LOWMEM_NR_LEVELS] = {
+	"none",
+	"low",
+	"medium",
+	"critical",
+};
+static int lowmem_notify_pct[LOWMEM_NR_LEVELS - 1] = {
+	200,
+	150,
+	120,
+};
+static int lowmem_notify_pct_size = LOWMEM_NR_LEVELS - 1;
+module_param_array_named(notify_pct, lowmem_notify_pct, int, &lowmem_notify_pct_size, S_IRUGO | S_IWUSR);
+static unsigned int lowmem_notify_interval_ms = 500;
+module_param_named(notify_interval_ms, lowmem_notify_interval_ms, uint, S_IRUGO | S_IWUSR);
+static int lowmem_notify_reclaim_pct[LOWMEM_NR_LEVELS - 1] = {
+	50,
+	25,
+	10,
+};
+static int lowmem_notify_reclaim_pct_size = LOWMEM_NR_LEVELS - 1;
+module_param_array_named(notify_reclaim_pct, lowmem_notify_reclaim_pct, int, &lowmem_notify_reclaim_pct_size, S_IRUGO | S_IWUSR);
+static unsigned int lowmem_notify_min_scan = 256;
+module_param_named(notify_min_scan, lowmem_notify_min_scan, uint, S_IRUGO | S_IWUSR);
+
+static DEFINE_SPINLOCK(lowmem_notify_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_notify_wq);
+static int lowmem_notify_level;
+static unsigned long lowmem_notify_seq;
+static unsigned int lowmem_notify_events[LOWMEM_NR_LEVELS];
+static u64 lowmem_notify_raise_ns;	/* when the level last left none */
+static int lowmem_notify_stopped;
+static int lowmem_reclaim_level;
+
+static void lowmem_notify_recheck(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_notify_work, lowmem_notify_recheck);
+
+static void lowmem_notify_kick(void)
+{
+	/* no-op while already pending */
+	if (!lowmem_notify_stopped)
+		schedule_delayed_work(&lowmem_notify_work,
+			msecs_to_jiffies(lowmem_notify_interval_ms));
+}
+
+#ifdef CONFIG_VM_EVENT_COUNTERS
+/* Everything below is only touched under lowmem_reclaim_mutex */
+static DEFINE_MUTEX(lowmem_reclaim_mutex);
+static unsigned long lowmem_vm_events[NR_VM_EVENT_ITEMS];
+static unsigned long lowmem_last_scanned;
+static unsigned long lowmem_last_reclaimed;
+static unsigned long lowmem_last_sample;
+
+/* sums a per-zone vm event, given its ZONE_NORMAL item */
+static unsigned long lowmem_zone_events(int normal)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < MAX_NR_ZONES; i++)
+		sum += lowmem_vm_events[normal - ZONE_NORMAL + i];
+	return sum;
+}
+
+/*
+ * Compares what vmscan reclaimed with what it scanned since the last sample
+ * and sets lowmem_reclaim_level accordingly.
+ */
+static void lowmem_sample_reclaim(void)
+{
+	unsigned long interval = msecs_to_jiffies(lowmem_notify_interval_ms);
+	unsigned long scanned, reclaimed;
+	unsigned long dscan, dreclaim;
+	int level = LOWMEM_LEVEL_NONE;
+	int i;
+
+	mutex_lock(&lowmem_reclaim_mutex);
+	all_vm_events(lowmem_vm_events);
+	scanned = lowmem_zone_events(PGSCAN_KSWAPD_NORMAL) +
+		  lowmem_zone_events(PGSCAN_DIRECT_NORMAL);
+	reclaimed = lowmem_zone_events(PGSTEAL_NORMAL);
+	dscan = scanned - lowmem_last_scanned;
+	dreclaim = reclaimed - lowmem_last_reclaimed;
+
+	/* an old sample would average over a long quiet stretch */
+	if (time_before(jiffies, lowmem_last_sample + 2 * interval) &&
+	    dscan >= lowmem_notify_min_scan) {
+		for (i = 0; i < lowmem_notify_reclaim_pct_size; i++)
+			if (dreclaim * 100 < dscan * lowmem_notify_reclaim_pct[i])
+				level = i + 1;
+		lowmem_print(4, "reclaim efficiency %lu/%lu\n",
+			     dreclaim, dscan);
+	}
+
+	lowmem_last_scanned = scanned;
+	lowmem_last_reclaimed = reclaimed;
+	lowmem_last_sample = jiffies;
+	lowmem_reclaim_level = level;
+	mutex_unlock(&lowmem_reclaim_mutex);
+}
+#else
+static inline void lowmem_sample_reclaim(void)
+{
+}
+#endif
+
+static void lowmem_notify_update(int other_free, int other_file)
+{
+	int array_size = ARRAY_SIZE(lowmem_minfree);
+	size_t max_minfree = 0;
+	size_t minfree;
+	int level = LOWMEM_LEVEL_NONE;
+	int changed;
+	int i;
+
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++)
+		max_minfree = max(max_minfree, lowmem_minfree[i]);
+
+	for (i = 0; i < lowmem_notify_pct_size; i++) {
+		minfree = max_minfree * lowmem_notify_pct[i] / 100;
+		if (other_free < minfree && other_file < minfree)
+			level = i + 1;
+	}
+	level = max(level, lowmem_reclaim_level);
+
+	spin_lock(&lowmem_notify_lock);
+	changed = level != lowmem_notify_level;
+	if (changed) {
+		if (lowmem_notify_level == LOWMEM_LEVEL_NONE)
+			lowmem_notify_raise_ns = ktime_to_ns(ktime_get());
+		lowmem_notify_level = level;
+		lowmem_notify_seq++;
+		lowmem_notify_events[level]++;
+	}
+	spin_unlock(&lowmem_notify_lock);
+
+	if (changed) {
+		lowmem_print(3, "memory pressure %s, ofree %d %d, "
+			     "reclaim %s\n", lowmem_level_names[level],
+			     other_free, other_file,
+			     lowmem_level_names[lowmem_reclaim_level]);
+		wake_up_interruptible(&lowmem_notify_wq);
+	}
+
+	if (level != LOWMEM_LEVEL_NONE)
+		lowmem_notify_kick();
+}
+
+static void lowmem_notify_refresh(void)
+{
+	lowmem_notify_update(global_page_state(NR_FREE_PAGES),
+			     global_page_state(NR_FILE_PAGES));
+}
+
+static void lowmem_notify_recheck(struct work_struct *work)
+{
+	lowmem_sample_reclaim();
+	lowmem_notify_refresh();
+}
+
+/* private_data holds the last sequence number this file has read */
+static int lowmem_notify_open(struct inode *inode, struct file *file)
+{
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (ret)
+		return ret;
+
+	/* make the first read return the current level straight away */
+	spin_lock(&lowmem_notify_lock);
+	file->private_data = (void *)(lowmem_notify_seq - 1);
+	spin_unlock(&lowmem_notify_lock);
+	return 0;
+}
+
+/* has the level changed since 'file' last read it? */
+static int lowmem_notify_changed(struct file *file)
+{
+	int ret;
+
+	spin_lock(&lowmem_notify_lock);
+	ret = (unsigned long)file->private_data != lowmem_notify_seq;
+	spin_unlock(&lowmem_notify_lock);
+	return ret;
+}
+
+static ssize_t lowmem_notify_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *pos)
+{
+	char level[16];
+	int len;
+	int ret;
+
+	lowmem_notify_refresh();
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (!lowmem_notify_changed(file))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(lowmem_notify_wq,
+					       lowmem_notify_changed(file));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&lowmem_notify_lock);
+	len = snprintf(level, sizeof(level), "%s\n",
+		       lowmem_level_names[lowmem_notify_level]);
+	if (count >= len)
+		file->private_data = (void *)lowmem_notify_seq;
+	spin_unlock(&lowmem_notify_lock);
+
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, level, len))
+		return -EFAULT;
+	return len;
+}
+
+static unsigned int lowmem_notify_poll(struct file *file, poll_table *wait)
+{
+	unsigned int ret = 0;
+
+	poll_wait(file, &lowmem_notify_wq, wait);
+	lowmem_notify_refresh();
+
+	if (lowmem_notify_changed(file))
+		ret = POLLIN | POLLRDNORM;
+
+	return ret;
+}
+
+static const struct file_operations lowmem_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_notify_open,
+	.read = lowmem_notify_read,
+	.poll = lowmem_notify_poll,
+};
+
+static struct miscdevice lowmem_notify_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "mem_pressure",
+	.fops = &lowmem_notify_fops,
+};
+static int lowmem_notify_registered;
+
+/*
+ * Everything below is protected by lowmem_mutex. Reclaimers that find it
+ * taken leave victim selection to the holder instead of piling on.
+ */
+static DEFINE_MUTEX(lowmem_mutex);
+
+/*
+ * Kill in progress: while the last victim still has its mm we don't kill
+ * again, since its memory is about to come back. Give up waiting after
+ * lowmem_deathpending_timeout jiffies in case it is stuck.
+ */
+static struct task_struct *lowmem_deathpending;
+static unsigned long lowmem_deathpending_expire;
+static u64 lowmem_kill_time_ns;
+static unsigned int lowmem_deathpending_timeout = HZ;
+module_param_named(deathpending_timeout, lowmem_deathpending_timeout, uint, S_IRUGO | S_IWUSR);
+
+/*
+ * Victim cache: the best candidates found by the last scan of the task list,
+ * ordered by oom_adj and then RSS, both descending. Kills that follow soon
+ * after a scan take the next candidate instead of walking the task list
+ * again. Entries are revalidated before use, and the cache is dropped as soon
+ * as an entry's oom_adj no longer matches.
+ */
+#define LOWMEM_CANDIDATES 8
+
+struct lowmem_candidate {
+	struct pid *pid;
+	int adj;
+	int tasksize;
+};
+
+static struct lowmem_candidate lowmem_candidates[LOWMEM_CANDIDATES];
+static int lowmem_nr_candidates;
+static int lowmem_next_candidate;
+static unsigned long lowmem_candidates_expire;
+static unsigned int lowmem_candidates_ttl = HZ / 2;
+module_param_named(candidates_ttl, lowmem_candidates_ttl, uint, S_IRUGO | S_IWUSR);
+
+static struct lowmem_stats {
+	unsigned int calls;		/* shrinks that had to find a victim */
+	unsigned int busy;		/* ... and found another reclaimer at it */
+	unsigned int scans;		/* task list walks */
+	unsigned int cache_hits;	/* victims taken from the cache */
+	unsigned int kills;
+	unsigned int deathpending_waits; /* shrinks skipped, kill in progress */
+	unsigned int deathpending_timeouts;
+	u64 stall_ns;			/* time spent selecting victims */
+	u64 stall_max_ns;
+	u64 reap_ns;			/* kill to victim's mm being released */
+	u64 reap_max_ns;
+	unsigned int unwarned_kills;	/* kills with no pressure signalled */
+	u64 warn_lead_ns;		/* pressure signalled to kill, others */
+	u64 warn_lead_min_ns;
+} lowmem_stats;
+
+/* How long before this kill were /dev/mem_pressure readers warned? */
+static void lowmem_account_warning(u64 kill_ns)
+{
+	u64 lead_ns;
+	int warned;
+
+	spin_lock(&lowmem_notify_lock);
+	warned = lowmem_notify_level != LOWMEM_LEVEL_NONE;
+	lead_ns = kill_ns - lowmem_notify_raise_ns;
+	spin_unlock(&lowmem_notify_lock);
+
+	if (!warned) {
+		lowmem_stats.unwarned_kills++;
+		return;
+	}
+	/* kills has already been bumped, so this is the first warned one */
+	if (lowmem_stats.kills == lowmem_stats.unwarned_kills + 1 ||
+	    lead_ns < lowmem_stats.warn_lead_min_ns)
+		lowmem_stats.warn_lead_min_ns = lead_ns;
+	lowmem_stats.warn_lead_ns += lead_ns;
+}
+
+static int lowmem_death_pending(void)
+{
+	struct task_struct *p = lowmem_deathpending;
+	int alive;
+	u64 reap_ns;
+
+	if (!p)
+		return 0;
+
+	task_lock(p);
+	alive = p->mm != NULL;
+	task_unlock(p);
+	if (alive && time_before(jiffies, lowmem_deathpending_expire))
+		return 1;
+
+	reap_ns = ktime_to_ns(ktime_get()) - lowmem_kill_time_ns;
+	if (alive) {
+		lowmem_stats.deathpending_timeouts++;
+		lowmem_print(2, "%d (%s) still alive after kill\n",
+			     p->pid, p->comm);
+	} else {
+		lowmem_stats.reap_ns += reap_ns;
+		if (reap_ns > lowmem_stats.reap_max_ns)
+			lowmem_stats.reap_max_ns = reap_ns;
+	}
+	trace_lowmem_reaped(p->pid, reap_ns, alive);
+	put_task_struct(p);
+	lowmem_deathpending = NULL;
+	return 0;
+}
+
+static void lowmem_flush_candidates(void)
+{
+	while (lowmem_next_candidate < lowmem_nr_candidates)
+		put_pid(lowmem_candidates[lowmem_next_candidate++].pid);
+	lowmem_nr_candidates = 0;
+	lowmem_next_candidate = 0;
+}
+
+static int lowmem_better(int adj, int tasksize, struct lowmem_candidate *c)
+{
+	return adj > c->adj || (adj == c->adj && tasksize > c->tasksize);
+}
+
+/* Caller holds tasklist_lock. */
+static void lowmem_add_candidate(struct task_struct *p, int tasksize)
+{
+	int adj = p->oomkilladj;
+	int i = lowmem_nr_candidates;
+
+	if (i == LOWMEM_CANDIDATES) {
+		if (!lowmem_better(adj, tasksize, &lowmem_candidates[i - 1]))
+			return;
+		put_pid(lowmem_candidates[--i].pid);
+	} else
+		lowmem_nr_candidates++;
+
+	for (; i > 0 && lowmem_better(adj, tasksize, &lowmem_candidates[i - 1]); i--)
+		lowmem_candidates[i] = lowmem_candidates[i - 1];
+	lowmem_candidates[i].pid = get_pid(task_pid(p));
+	lowmem_candidates[i].adj = adj;
+	lowmem_candidates[i].tasksize = tasksize;
+}
+
+static void lowmem_scan(int min_adj)
 {
 	struct task_struct *p;
-	struct task_struct *selected = NULL;
-	int rem = 0;
 	int tasksize;
+
+	lowmem_flush_candidates();
+	lowmem_stats.scans++;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		if (p->oomkilladj < min_adj || !p->mm)
+			continue;
+		tasksize = get_mm_rss(p->mm);
+		if (tasksize <= 0)
+			continue;
+		lowmem_add_candidate(p, tasksize);
+	}
+	read_unlock(&tasklist_lock);
+
+	lowmem_candidates_expire = jiffies + lowmem_candidates_ttl;
+}
+
+/*
+ * Returns the next usable candidate with a reference held, and its current
+ * size in 'tasksize', or NULL if the cache is empty or stale.
+ */
+static struct task_struct *lowmem_next_victim(int min_adj, int *tasksize)
+{
+	struct lowmem_candidate *c;
+	struct task_struct *p;
+
+	if (time_after(jiffies, lowmem_candidates_expire))
+		lowmem_flush_candidates();
+
+	while (lowmem_next_candidate < lowmem_nr_candidates) {
+		c = &lowmem_candidates[lowmem_next_candidate++];
+		rcu_read_lock();
+		p = pid_task(c->pid, PIDTYPE_PID);
+		if (p)
+			get_task_struct(p);
+		rcu_read_unlock();
+		put_pid(c->pid);
+		if (!p)
+			continue;
+		if (p->oomkilladj != c->adj) {
+			/* the ordering no longer holds, rescan */
+			put_task_struct(p);
+			break;
+		}
+		if (c->adj < min_adj) {
+			/* and neither does anything after this one */
+			put_task_struct(p);
+			break;
+		}
+		task_lock(p);
+		*tasksize = p->mm ? get_mm_rss(p->mm) : 0;
+		task_unlock(p);
+		if (*tasksize > 0)
+			return p;
+		put_task_struct(p);
+	}
+	lowmem_flush_candidates();
+	return NULL;
+}
+
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
+	u64 start_ns, stall_ns;
 	if(lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if(lowmem_minfree_size < array_size)
@@ -71,6 +566,10 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			break;
 		}
 	}
+	lowmem_notify_update(other_free, other_file);
+	/* reclaim is running: sample its efficiency */
+	if (nr_to_scan > 0)
+		lowmem_notify_kick();
 	if(nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n", nr_to_scan, gfp_mask, other_free, other_file, min_adj);
 	rem = global_page_state(NR_ACTIVE_ANON) +
@@ -82,46 +581,130 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		return rem;
 	}
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		if (p->oomkilladj < min_adj || !p->mm)
-			continue;
-		tasksize = get_mm_rss(p->mm);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (p->oomkilladj < selected->oomkilladj)
-				continue;
-			if (p->oomkilladj == selected->oomkilladj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-		             p->pid, p->comm, p->oomkilladj, tasksize);
+	if (!mutex_trylock(&lowmem_mutex)) {
+		lowmem_stats.busy++;
+		return rem;
+	}
+	start_ns = ktime_to_ns(ktime_get());
+	lowmem_stats.calls++;
+
+	if (lowmem_death_pending()) {
+		lowmem_stats.deathpending_waits++;
+		goto out;
+	}
+
+	selected = lowmem_next_victim(min_adj, &selected_tasksize);
+	if (selected)
+		lowmem_stats.cache_hits++;
+	else {
+		lowmem_scan(min_adj);
+		selected = lowmem_next_victim(min_adj, &selected_tasksize);
 	}
 	if(selected != NULL) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 		             selected->pid, selected->comm,
 		             selected->oomkilladj, selected_tasksize);
+		trace_lowmem_kill(selected, selected_tasksize, min_adj,
+				  other_free, other_file);
 		force_sig(SIGKILL, selected);
 		rem -= selected_tasksize;
+		lowmem_stats.kills++;
+		lowmem_deathpending = selected;
+		lowmem_deathpending_expire = jiffies + lowmem_deathpending_timeout;
+		lowmem_kill_time_ns = ktime_to_ns(ktime_get());
+		lowmem_account_warning(lowmem_kill_time_ns);
 	}
+out:
+	stall_ns = ktime_to_ns(ktime_get()) - start_ns;
+	lowmem_stats.stall_ns += stall_ns;
+	if (stall_ns > lowmem_stats.stall_max_ns)
+		lowmem_stats.stall_max_ns = stall_ns;
+	mutex_unlock(&lowmem_mutex);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n", nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct lowmem_stats stats;
+	unsigned int events[LOWMEM_NR_LEVELS];
+	int i;
+
+	mutex_lock(&lowmem_mutex);
+	stats = lowmem_stats;
+	mutex_unlock(&lowmem_mutex);
+	spin_lock(&lowmem_notify_lock);
+	memcpy(events, lowmem_notify_events, sizeof(events));
+	spin_unlock(&lowmem_notify_lock);
+
+	seq_printf(m, "calls: %u\n", stats.calls);
+	seq_printf(m, "busy: %u\n", stats.busy);
+	seq_printf(m, "scans: %u\n", stats.scans);
+	seq_printf(m, "cache_hits: %u\n", stats.cache_hits);
+	seq_printf(m, "kills: %u\n", stats.kills);
+	seq_printf(m, "deathpending_waits: %u\n", stats.deathpending_waits);
+	seq_printf(m, "deathpending_timeouts: %u\n",
+		   stats.deathpending_timeouts);
+	seq_printf(m, "stall_ns: %llu\n", (unsigned long long)stats.stall_ns);
+	seq_printf(m, "stall_max_ns: %llu\n",
+		   (unsigned long long)stats.stall_max_ns);
+	seq_printf(m, "reap_ns: %llu\n", (unsigned long long)stats.reap_ns);
+	seq_printf(m, "reap_max_ns: %llu\n",
+		   (unsigned long long)stats.reap_max_ns);
+	seq_printf(m, "unwarned_kills: %u\n", stats.unwarned_kills);
+	seq_printf(m, "warn_lead_ns: %llu\n",
+		   (unsigned long long)stats.warn_lead_ns);
+	seq_printf(m, "warn_lead_min_ns: %llu\n",
+		   (unsigned long long)stats.warn_lead_min_ns);
+	for (i = 0; i < LOWMEM_NR_LEVELS; i++)
+		seq_printf(m, "pressure_%s: %u\n", lowmem_level_names[i],
+			   events[i]);
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, NULL);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.open = lowmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *lowmem_debugfs;
+
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	ret = misc_register(&lowmem_notify_misc);
+	if (ret)
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "mem_pressure device\n");
+	lowmem_notify_registered = !ret;
 	register_shrinker(&lowmem_shrinker);
+	lowmem_debugfs = debugfs_create_file("lowmemorykiller", S_IRUGO, NULL,
+					     NULL, &lowmem_stats_fops);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	if (lowmem_notify_registered)
+		misc_deregister(&lowmem_notify_misc);
+	lowmem_notify_stopped = 1;
+	cancel_delayed_work_sync(&lowmem_notify_work);
+	debugfs_remove(lowmem_debugfs);
+	mutex_lock(&lowmem_mutex);
+	lowmem_flush_candidates();
+	if (lowmem_deathpending)
+		put_task_struct(lowmem_deathpending);
+	lowmem_deathpending = NULL;
+	mutex_unlock(&lowmem_mutex);
 }
 
 module_init(lowmem_init);
@@ -23,7 +23,8 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
-#include <linux/lzo.h>
+#include <linux/jhash.h>
+#include <linux/kthread.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -294,8 +295,57 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 
 	s->bdev_num_reads = stat64_read(rzs, &rs->bdev_num_reads);
 	s->bdev_num_writes = stat64_read(rzs, &rs->bdev_num_writes);
+
+	spin_lock_irq(&rzs->bdev_read_lock);
+	s->bdev_read_ns = rs->bdev_read_ns;
+	s->bdev_read_max_ns = rs->bdev_read_max_ns;
+	spin_unlock_irq(&rzs->bdev_read_lock);
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
+
+	s->wb_pages = rzs->stats.wb_pages;
+	s->wb_bios = rzs->stats.wb_bios;
+
+	spin_lock(&rzs->dedup_lock);
+	s->pages_dedup = rzs->stats.pages_dedup;
+	s->dedup_hits = rzs->stats.dedup_hits;
+	s->dedup_saved = rzs->stats.dedup_saved;
+	spin_unlock(&rzs->dedup_lock);
+
+	BUILD_BUG_ON(RZS_NR_SIZE_CLASSES != XV_NR_SIZE_CLASSES);
+	BUILD_BUG_ON(RZS_NR_FILL_CLASSES != XV_NR_FILL_CLASSES);
+	if (rzs->init_done) {
+		s->mem_used_objects = xv_get_used_size_bytes(rzs->mem_pool);
+		xv_get_histograms(rzs->mem_pool, s->size_hist, s->fill_hist);
+	}
+	s->compact_pages = rzs->stats.compact_pages;
+	s->compact_moved = rzs->stats.compact_moved;
+
+	{
+	int i;
+
+	s->cur_backend = rzs->cur_backend;
+	for (i = 0; i < rzs->num_backends; i++) {
+		struct rzs_backend *b = &rzs->backends[i];
+		struct ramzswap_ioctl_backend_stats *bs = &s->backends[i];
+
+		strcpy(bs->name, b->name);
+		bs->pages_stored = b->pages_stored;
+		bs->compr_data_size = b->compr_size;
+		spin_lock(&rzs->stat64_lock);
+		bs->num_compress = b->num_compress;
+		bs->compress_ns = b->compress_ns;
+		bs->num_decompress = b->num_decompress;
+		bs->decompress_ns = b->decompress_ns;
+		spin_unlock(&rzs->stat64_lock);
+	}
+	}
+
+	s->num_streams = rzs->num_streams;
+	spin_lock(&rzs->stream_lock);
+	s->stream_waits = rzs->stats.stream_waits;
+	s->stream_wait_ns = rzs->stats.stream_wait_ns;
+	spin_unlock(&rzs->stream_lock);
 }
 
 static int add_backing_swap_extent(struct ramzswap *rzs,
@@ -615,13 +665,456 @@ static u32 map_backing_swap_page(struct ramzswap *rzs, u32 pagenum)
 	return se->phy_pagenum + se_offset;
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+static void rzs_destroy_streams(struct ramzswap *rzs)
+{
+	int i;
+	struct rzs_stream *zstrm, *next;
+
+	list_for_each_entry_safe(zstrm, next, &rzs->idle_streams, list) {
+		list_del(&zstrm->list);
+		for (i = 0; i < rzs->num_backends; i++)
+			if (zstrm->tfm[i])
+				crypto_free_comp(zstrm->tfm[i]);
+		free_pages((unsigned long)zstrm->buffer, 1);
+		kfree(zstrm);
+	}
+}
+
+static int rzs_create_streams(struct ramzswap *rzs)
+{
+	int i;
+	struct rzs_stream *zstrm;
+
+	for (i = 0; i < num_online_cpus(); i++) {
+		zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+		if (!zstrm)
+			goto fail;
+		list_add(&zstrm->list, &rzs->idle_streams);
+		rzs->num_streams++;
+
+		zstrm->tfm[0] = crypto_alloc_comp(rzs->backends[0].name, 0, 0);
+		if (IS_ERR(zstrm->tfm[0])) {
+			zstrm->tfm[0] = NULL;
+			pr_err("Error allocating %s compressor!\n",
+				rzs->backends[0].name);
+			goto fail;
+		}
+
+		/* Compressed output can be a bit larger than its input */
+		zstrm->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!zstrm->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	rzs_destroy_streams(rzs);
+	rzs->num_streams = 0;
+	return -ENOMEM;
+}
+
+/*
+ * Grab an idle compression stream, waiting for one if all are busy.
+ */
+static struct rzs_stream *rzs_get_stream(struct ramzswap *rzs)
+{
+	struct rzs_stream *zstrm;
+	ktime_t start;
+
+	spin_lock(&rzs->stream_lock);
+	if (list_empty(&rzs->idle_streams)) {
+		start = ktime_get();
+		do {
+			spin_unlock(&rzs->stream_lock);
+			wait_event(rzs->stream_wait,
+				   !list_empty(&rzs->idle_streams));
+			spin_lock(&rzs->stream_lock);
+		} while (list_empty(&rzs->idle_streams));
+		rzs->stats.stream_waits++;
+		rzs->stats.stream_wait_ns +=
+			ktime_to_ns(ktime_sub(ktime_get(), start));
+	}
+	zstrm = list_first_entry(&rzs->idle_streams, struct rzs_stream, list);
+	list_del(&zstrm->list);
+	spin_unlock(&rzs->stream_lock);
+
+	return zstrm;
+}
+
+static void rzs_put_stream(struct ramzswap *rzs, struct rzs_stream *zstrm)
+{
+	spin_lock(&rzs->stream_lock);
+	list_add(&zstrm->list, &rzs->idle_streams);
+	spin_unlock(&rzs->stream_lock);
+
+	wake_up(&rzs->stream_wait);
+}
+
+/*
+ * Switch the compressor used for new pages to 'name', loading it if this
+ * device hasn't used it before. Pages already stored keep the backend that
+ * produced them.
+ */
+static int rzs_set_backend(struct ramzswap *rzs, const char *name)
+{
+	int i, id, ret = 0;
+	struct rzs_stream *zstrm, *next;
+	LIST_HEAD(streams);
+
+	mutex_lock(&rzs->backend_lock);
+
+	for (id = 0; id < rzs->num_backends; id++)
+		if (!strcmp(rzs->backends[id].name, name))
+			goto out;
+
+	if (rzs->num_backends == MAX_COMP_BACKENDS) {
+		ret = -ENOSPC;
+		goto out_unlock;
+	}
+
+	/* Quiesce: take every stream so none is in use while we add tfms */
+	for (i = 0; i < rzs->num_streams; i++) {
+		zstrm = rzs_get_stream(rzs);
+		list_add(&zstrm->list, &streams);
+	}
+
+	list_for_each_entry(zstrm, &streams, list) {
+		zstrm->tfm[id] = crypto_alloc_comp(name, 0, 0);
+		if (IS_ERR(zstrm->tfm[id])) {
+			ret = PTR_ERR(zstrm->tfm[id]);
+			zstrm->tfm[id] = NULL;
+			break;
+		}
+	}
+
+	if (ret) {
+		list_for_each_entry(zstrm, &streams, list) {
+			if (zstrm->tfm[id])
+				crypto_free_comp(zstrm->tfm[id]);
+			zstrm->tfm[id] = NULL;
+		}
+	} else {
+		memset(&rzs->backends[id], 0, sizeof(rzs->backends[id]));
+		strcpy(rzs->backends[id].name, name);
+		rzs->num_backends++;
+	}
+
+	list_for_each_entry_safe(zstrm, next, &streams, list) {
+		list_del(&zstrm->list);
+		rzs_put_stream(rzs, zstrm);
+	}
+	if (ret)
+		goto out_unlock;
+
+out:
+	rzs->cur_backend = id;
+	pr_info("Compressing new pages with %s\n", name);
+out_unlock:
+	mutex_unlock(&rzs->backend_lock);
+	return ret;
+}
+
+static int rzs_get_backend(struct ramzswap *rzs, u32 index)
+{
+	return (rzs->table[index].flags & RZS_BACKEND_MASK) >>
+			RZS_BACKEND_SHIFT;
+}
+
+static void rzs_set_backend_flag(struct ramzswap *rzs, u32 index, int id)
+{
+	rzs->table[index].flags &= ~RZS_BACKEND_MASK;
+	rzs->table[index].flags |= id << RZS_BACKEND_SHIFT;
+}
+
+static int rzs_create_dedup(struct ramzswap *rzs, size_t num_pages)
+{
+	unsigned int i, size;
+
+	/* About one bucket per four slots */
+	size = roundup_pow_of_two(max_t(size_t, num_pages / 4, 1));
+	rzs->dedup_table = vmalloc(size * sizeof(*rzs->dedup_table));
+	if (!rzs->dedup_table)
+		return -ENOMEM;
+
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&rzs->dedup_table[i]);
+	rzs->dedup_mask = size - 1;
+
+	return 0;
+}
+
+static void rzs_destroy_dedup(struct ramzswap *rzs)
+{
+	unsigned int i;
+	struct rzs_dedup_entry *de;
+	struct hlist_node *pos, *n;
+
+	if (!rzs->dedup_table)
+		return;
+
+	for (i = 0; i <= rzs->dedup_mask; i++)
+		hlist_for_each_entry_safe(de, pos, n,
+				&rzs->dedup_table[i], node)
+			kfree(de);
+
+	vfree(rzs->dedup_table);
+	rzs->dedup_table = NULL;
+	rzs->dedup_mask = 0;
+}
+
+/*
+ * Identical pages compress to identical objects with the same backend.
+ * If an object matching the one in 'src' is already stored, take a
+ * reference to it and point table[index] at it. Called with rzs->lock
+ * held, so no other writer can store the same object meanwhile.
+ */
+static int rzs_dedup_find(struct ramzswap *rzs, u32 index, int id,
+			void *src, unsigned int clen, u32 checksum)
+{
+	int found = 0;
+	unsigned char *cmem;
+	struct zobj_header *zheader;
+	struct rzs_dedup_entry *de;
+	struct hlist_node *pos;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(de, pos,
+			&rzs->dedup_table[checksum & rzs->dedup_mask], node) {
+		if (de->checksum != checksum || de->backend != id)
+			continue;
+
+		cmem = kmap_atomic(de->page, KM_USER1) + de->offset;
+		zheader = (struct zobj_header *)cmem;
+		if (xv_get_object_size(cmem) == clen + sizeof(*zheader) &&
+				!memcmp(cmem + sizeof(*zheader), src, clen)) {
+			zheader->refcount++;
+			found = 1;
+		}
+		kunmap_atomic(cmem, KM_USER1);
+
+		if (found) {
+			rzs->table[index].page = de->page;
+			rzs->table[index].offset = de->offset;
+			rzs->stats.pages_dedup++;
+			rzs->stats.dedup_hits++;
+			rzs->stats.dedup_saved += clen;
+			break;
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	return found;
+}
+
+/*
+ * Make the object just stored at table[index] findable by later writes.
+ * Without an index entry the object is simply never shared.
+ */
+static void rzs_dedup_insert(struct ramzswap *rzs, u32 index, int id,
+			u32 checksum)
+{
+	struct rzs_dedup_entry *de;
+
+	de = kmalloc(sizeof(*de), GFP_NOIO);
+	if (!de)
+		return;
+
+	de->page = rzs->table[index].page;
+	de->offset = rzs->table[index].offset;
+	de->checksum = checksum;
+	de->backend = id;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&de->node,
+		&rzs->dedup_table[checksum & rzs->dedup_mask]);
+	spin_unlock(&rzs->dedup_lock);
+}
+
+/* Called with dedup_lock held, once the last reference is gone */
+static struct rzs_dedup_entry *rzs_dedup_unhash(struct ramzswap *rzs,
+			struct page *page, u32 offset, u32 checksum)
+{
+	struct rzs_dedup_entry *de;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(de, pos,
+			&rzs->dedup_table[checksum & rzs->dedup_mask], node) {
+		if (de->page == page && de->offset == offset) {
+			hlist_del(&de->node);
+			return de;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * xv_compact() callback: the object at <page, offset> has been copied to
+ * <new_page, new_offset>. Called with rzs->lock and migrate_lock held for
+ * write, so nothing else can be using the object.
+ */
+static int rzs_move_object(void *private, struct page *page, u32 offset,
+			struct page *new_page, u32 new_offset)
+{
+	u32 index, refcount, checksum;
+	struct ramzswap *rzs = private;
+	struct zobj_header *zheader;
+	struct rzs_dedup_entry *de;
+
+	zheader = kmap_atomic(new_page, KM_USER0) + new_offset;
+	index = zheader->table_idx;
+	refcount = zheader->refcount;
+	checksum = zheader->checksum;
+	kunmap_atomic(zheader, KM_USER0);
+
+	/*
+	 * Only the slot that stored the object is known. Shared objects,
+	 * or ones whose storing slot has moved on, stay where they are.
+	 */
+	if (refcount != 1 || rzs->table[index].page != page ||
+			rzs->table[index].offset != offset)
+		return -EBUSY;
+
+	spin_lock(&rzs->dedup_lock);
+	de = rzs_dedup_unhash(rzs, page, offset, checksum);
+	if (de) {
+		de->page = new_page;
+		de->offset = new_offset;
+		hlist_add_head(&de->node,
+			&rzs->dedup_table[checksum & rzs->dedup_mask]);
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	rzs->table[index].page = new_page;
+	rzs->table[index].offset = new_offset;
+	rzs->stats.compact_moved++;
+
+	return 0;
+}
+
+/*
+ * Scan up to nr_scan pages of the memory pool, emptying sparse ones.
+ * Called with rzs->lock held. Returns the number of pages freed.
+ */
+static int ramzswap_compact(struct ramzswap *rzs, u32 nr_scan)
+{
+	int freed;
+
+	write_lock(&rzs->migrate_lock);
+	freed = xv_compact(rzs->mem_pool, nr_scan, compact_max_used,
+				rzs_move_object, rzs);
+	write_unlock(&rzs->migrate_lock);
+
+	rzs->stats.compact_pages += freed;
+
+	return freed;
+}
+
+/* Called with rzs->lock held */
+static int rzs_should_compact(struct ramzswap *rzs)
+{
+	u64 total, used;
+
+	if (time_before(jiffies, rzs->next_compact))
+		return 0;
+
+	total = xv_get_total_size_bytes(rzs->mem_pool);
+	if (total < (u64)compact_min_pages << PAGE_SHIFT)
+		return 0;
+
+	used = xv_get_used_size_bytes(rzs->mem_pool);
+	return (total - used) * 100 > total * compact_frag_pct;
+}
+
+/*
+ * Compact the whole pool in small batches, so that readers and writers
+ * are held off only briefly.
+ */
+static void ramzswap_compact_work(struct work_struct *work)
+{
+	u32 nr_pages, batch = 32;
+	struct ramzswap *rzs;
+
+	rzs = container_of(work, struct ramzswap, compact_work);
+
+	mutex_lock(&rzs->lock);
+	if (!rzs->init_done) {
+		mutex_unlock(&rzs->lock);
+		return;
+	}
+	nr_pages = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+	mutex_unlock(&rzs->lock);
+
+	while (nr_pages) {
+		batch = min(batch, nr_pages);
+		nr_pages -= batch;
+
+		mutex_lock(&rzs->lock);
+		if (!rzs->init_done) {
+			mutex_unlock(&rzs->lock);
+			return;
+		}
+		ramzswap_compact(rzs, batch);
+		mutex_unlock(&rzs->lock);
+
+		cond_resched();
+	}
+
+	/* Don't retry at once if objects could not be moved */
+	mutex_lock(&rzs->lock);
+	rzs->next_compact = jiffies + HZ;
+	mutex_unlock(&rzs->lock);
+}
+
+/*
+ * Compaction only moves objects into free space the pool already has,
+ * so it is safe in any reclaim context. Devices busy with I/O are
+ * skipped.
+ */
+static int ramzswap_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	int i, nr_free = 0;
+	u64 total, used;
+	struct ramzswap *rzs;
+
+	for (i = 0; i < num_devices; i++) {
+		rzs = &devices[i];
+		if (!mutex_trylock(&rzs->lock))
+			continue;
+		if (rzs->init_done) {
+			if (nr_to_scan > 0)
+				ramzswap_compact(rzs, nr_to_scan);
+			total = xv_get_total_size_bytes(rzs->mem_pool);
+			used = xv_get_used_size_bytes(rzs->mem_pool);
+			nr_free += (total - used) >> PAGE_SHIFT;
+		}
+		mutex_unlock(&rzs->lock);
+	}
+
+	return nr_free;
+}
+
+static struct shrinker ramzswap_shrinker = {
+	.shrink = ramzswap_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/* Called with migrate_lock held */
+static void __ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
-	u32 clen;
+	u32 clen, refs;
 	void *obj;
+	struct zobj_header *zheader;
+	struct rzs_dedup_entry *de = NULL;
+	struct rzs_backend *backend;
+	struct page *page;
+	u32 offset;
 
-	struct page *page = rzs->table[index].page;
-	u32 offset = rzs->table[index].offset;
+	page = rzs->table[index].page;
+	offset = rzs->table[index].offset;
 
 	if (unlikely(!page)) {
 		/*
@@ -644,19 +1137,362 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 	}
 
 	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	zheader = obj;
+	clen = xv_get_object_size(obj) - sizeof(*zheader);
+
+	spin_lock(&rzs->dedup_lock);
+	refs = --zheader->refcount;
+	if (refs) {
+		rzs->stats.pages_dedup--;
+		rzs->stats.dedup_saved -= clen;
+	} else {
+		de = rzs_dedup_unhash(rzs, page, offset, zheader->checksum);
+	}
+	spin_unlock(&rzs->dedup_lock);
 	kunmap_atomic(obj, KM_USER0);
 
-	xv_free(rzs->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		stat_dec(&rzs->stats.good_compress);
 
+	backend = &rzs->backends[rzs_get_backend(rzs, index)];
+	backend->pages_stored--;
+
+	/* Other slots still use the object: no memory is released */
+	if (refs) {
+		clen = 0;
+		goto out;
+	}
+
+	kfree(de);
+	xv_free(rzs->mem_pool, page, offset);
+	backend->compr_size -= clen;
+
 out:
 	rzs->stats.compr_size -= clen;
 	stat_dec(&rzs->stats.pages_stored);
 
 	rzs->table[index].page = NULL;
 	rzs->table[index].offset = 0;
+	rzs->table[index].flags &= ~(RZS_BACKEND_MASK | BIT(RZS_ACCESSED) |
+					BIT(RZS_WRITEBACK));
+}
+
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
+	read_lock(&rzs->migrate_lock);
+	__ramzswap_free_page(rzs, index);
+	read_unlock(&rzs->migrate_lock);
+}
+
+/*-- Background writeback */
+
+static int rzs_wb_over(struct ramzswap *rzs, unsigned pct)
+{
+	return rzs->stats.compr_size > rzs->memlimit / 100 * pct;
+}
+
+static int rzs_wb_in_flight(struct ramzswap *rzs, u32 index)
+{
+	return rzs->wb_active && index >= rzs->wb_first &&
+		index <= rzs->wb_last;
+}
+
+/*
+ * Pick up to RZS_WB_BATCH slots to write back, sweeping a clock hand
+ * over the table. Slots accessed since the last sweep get a second
+ * chance; incompressible pages never do. Their contents are copied out
+ * to the batch pages, so that the bios don't depend on objects that
+ * may be freed or moved meanwhile.
+ */
+static int rzs_wb_fill(struct ramzswap *rzs, struct rzs_wb_batch *wb)
+{
+	int i, ret, id;
+	u32 index, scanned, chunk, num_pages, clen;
+	struct rzs_stream *zstrm;
+	unsigned char *user_mem, *cmem;
+
+	num_pages = rzs->disksize >> PAGE_SHIFT;
+	wb->nr = 0;
+
+	zstrm = rzs_get_stream(rzs);
+
+	/* Sweep at most one full turn, dropping the locks now and then */
+	for (scanned = 0; scanned < num_pages && wb->nr < RZS_WB_BATCH; ) {
+		mutex_lock(&rzs->lock);
+		write_lock(&rzs->migrate_lock);
+		for (chunk = 0; chunk < 256 && scanned < num_pages &&
+				wb->nr < RZS_WB_BATCH; chunk++, scanned++) {
+			index = rzs->wb_hand;
+			rzs->wb_hand = (index + 1) % num_pages;
+
+			/* Slot 0 holds the swap header */
+			if (!index || !rzs->table[index].page)
+				continue;
+
+			if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED) &&
+				rzs_test_flag(rzs, index, RZS_ACCESSED)) {
+				rzs_clear_flag(rzs, index, RZS_ACCESSED);
+				continue;
+			}
+
+			rzs_set_flag(rzs, index, RZS_WRITEBACK);
+			wb->index[wb->nr++] = index;
+		}
+		write_unlock(&rzs->migrate_lock);
+		mutex_unlock(&rzs->lock);
+	}
+
+	mutex_lock(&rzs->lock);
+	write_lock(&rzs->migrate_lock);
+	if (wb->nr) {
+		rzs->wb_first = rzs->wb_last = wb->index[0];
+		for (i = 1; i < wb->nr; i++) {
+			rzs->wb_first = min(rzs->wb_first, wb->index[i]);
+			rzs->wb_last = max(rzs->wb_last, wb->index[i]);
+		}
+		rzs->wb_active = 1;
+	}
+	write_unlock(&rzs->migrate_lock);
+	mutex_unlock(&rzs->lock);
+
+	for (i = 0; i < wb->nr; i++) {
+		index = wb->index[i];
+
+		/*
+		 * Exclusive: ramzswap_free_page() only takes migrate_lock
+		 * for reading, and must not free the object under us.
+		 */
+		write_lock(&rzs->migrate_lock);
+		/* Freed since it was picked */
+		if (!rzs_test_flag(rzs, index, RZS_WRITEBACK)) {
+			write_unlock(&rzs->migrate_lock);
+			wb->index[i] = 0;
+			continue;
+		}
+
+		user_mem = kmap_atomic(wb->page[i], KM_USER0);
+		cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
+				rzs->table[index].offset;
+
+		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+			memcpy(user_mem, cmem, PAGE_SIZE);
+			ret = 0;
+		} else {
+			id = rzs_get_backend(rzs, index);
+			clen = PAGE_SIZE;
+			ret = crypto_comp_decompress(zstrm->tfm[id],
+				cmem + sizeof(struct zobj_header),
+				xv_get_object_size(cmem) -
+					sizeof(struct zobj_header),
+				user_mem, &clen);
+		}
+
+		kunmap_atomic(user_mem, KM_USER0);
+		kunmap_atomic(cmem, KM_USER1);
+		write_unlock(&rzs->migrate_lock);
+
+		/* should NEVER happen; the slot just stays in memory */
+		if (unlikely(ret)) {
+			pr_err("Decompression failed! err=%d, page=%u\n",
+				ret, index);
+			wb->index[i] = 0;
+		}
+	}
+
+	rzs_put_stream(rzs, zstrm);
+
+	return wb->nr;
+}
+
+static void rzs_wb_end_io(struct bio *bio, int err)
+{
+	struct rzs_wb_batch *wb = bio->bi_private;
+
+	if (err)
+		wb->error = err;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&wb->pending))
+		complete(&wb->done);
+}
+
+static void rzs_wb_submit_bio(struct ramzswap *rzs, struct rzs_wb_batch *wb,
+			struct bio *bio)
+{
+	atomic_inc(&wb->pending);
+	rzs->stats.wb_bios++;
+	submit_bio(WRITE, bio);
+}
+
+/*
+ * Write the batch out, merging slots that are adjacent on the backing
+ * device into one bio, and wait for it.
+ */
+static void rzs_wb_write(struct ramzswap *rzs, struct rzs_wb_batch *wb)
+{
+	int i;
+	sector_t sector, next_sector = 0;
+	struct bio *bio = NULL;
+
+	atomic_set(&wb->pending, 1);
+	wb->error = 0;
+	init_completion(&wb->done);
+
+	for (i = 0; i < wb->nr; i++) {
+		if (!wb->index[i])
+			continue;
+
+		sector = (sector_t)map_backing_swap_page(rzs, wb->index[i])
+					<< SECTORS_PER_PAGE_SHIFT;
+		if (bio && sector == next_sector &&
+				bio_add_page(bio, wb->page[i], PAGE_SIZE, 0)
+					== PAGE_SIZE) {
+			next_sector += SECTORS_PER_PAGE;
+			continue;
+		}
+
+		if (bio)
+			rzs_wb_submit_bio(rzs, wb, bio);
+
+		bio = bio_alloc(GFP_NOIO, RZS_WB_BATCH - i);
+		if (!bio) {
+			/* rzs_wb_finish() leaves the whole batch in memory */
+			wb->error = -ENOMEM;
+			break;
+		}
+		bio->bi_bdev = rzs->backing_swap;
+		bio->bi_sector = sector;
+		bio->bi_end_io = rzs_wb_end_io;
+		bio->bi_private = wb;
+		bio_add_page(bio, wb->page[i], PAGE_SIZE, 0);
+		next_sector = sector + SECTORS_PER_PAGE;
+	}
+
+	if (bio)
+		rzs_wb_submit_bio(rzs, wb, bio);
+
+	if (!atomic_dec_and_test(&wb->pending))
+		wait_for_completion(&wb->done);
+}
+
+/*
+ * The batch is on disk: drop the slots from memory, so that their next
+ * read goes to backing swap. On error they simply stay.
+ */
+static void rzs_wb_finish(struct ramzswap *rzs, struct rzs_wb_batch *wb)
+{
+	int i;
+	u32 index;
+
+	mutex_lock(&rzs->lock);
+	write_lock(&rzs->migrate_lock);
+	for (i = 0; i < wb->nr; i++) {
+		index = wb->index[i];
+		if (!index || !rzs_test_flag(rzs, index, RZS_WRITEBACK))
+			continue;
+
+		rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+		if (wb->error)
+			continue;
+
+		__ramzswap_free_page(rzs, index);
+		rzs->stats.wb_pages++;
+	}
+	rzs->wb_active = 0;
+	write_unlock(&rzs->migrate_lock);
+	mutex_unlock(&rzs->lock);
+
+	wake_up(&rzs->wb_idle);
+
+	if (wb->error)
+		pr_err("Writeback to backing swap failed: err=%d\n",
+			wb->error);
+}
+
+static int ramzswap_writeback_thread(void *data)
+{
+	struct ramzswap *rzs = data;
+	struct rzs_wb_batch *wb = rzs->wb_batch;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(rzs->wb_wait,
+			kthread_should_stop() || rzs_wb_over(rzs, wb_high_pct));
+
+		while (!kthread_should_stop() && rzs_wb_over(rzs, wb_low_pct)) {
+			if (!rzs_wb_fill(rzs, wb)) {
+				/* Nothing to write back right now */
+				schedule_timeout_interruptible(HZ);
+				break;
+			}
+
+			rzs_wb_write(rzs, wb);
+			rzs_wb_finish(rzs, wb);
+			if (wb->error) {
+				schedule_timeout_interruptible(HZ);
+				break;
+			}
+			cond_resched();
+		}
+	}
+
+	return 0;
+}
+
+static void rzs_stop_writeback(struct ramzswap *rzs)
+{
+	int i;
+	struct rzs_wb_batch *wb = rzs->wb_batch;
+
+	if (rzs->wb_task) {
+		kthread_stop(rzs->wb_task);
+		rzs->wb_task = NULL;
+	}
+
+	if (!wb)
+		return;
+
+	for (i = 0; i < RZS_WB_BATCH; i++)
+		if (wb->page[i])
+			__free_page(wb->page[i]);
+	kfree(wb);
+	rzs->wb_batch = NULL;
+	rzs->wb_hand = 0;
+	rzs->wb_active = 0;
+}
+
+/*
+ * Without the thread, pages are only sent to backing swap synchronously
+ * once memlimit is reached or when they don't compress.
+ */
+static void rzs_start_writeback(struct ramzswap *rzs)
+{
+	int i;
+	struct rzs_wb_batch *wb;
+
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		goto fail;
+	rzs->wb_batch = wb;
+
+	for (i = 0; i < RZS_WB_BATCH; i++) {
+		wb->page[i] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+		if (!wb->page[i])
+			goto fail;
+	}
+
+	rzs->wb_task = kthread_run(ramzswap_writeback_thread, rzs,
+				"ramzswap_wb%d", (int)(rzs - devices));
+	if (IS_ERR(rzs->wb_task)) {
+		rzs->wb_task = NULL;
+		goto fail;
+	}
+
+	return;
+
+fail:
+	pr_warning("Error starting writeback thread, "
+		"continuing without it\n");
+	rzs_stop_writeback(rzs);
 }
 
 static int handle_zero_page(struct bio *bio)
@@ -675,30 +1511,55 @@ static int handle_zero_page(struct bio *bio)
 	return 0;
 }
 
-static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
-{
-	u32 index;
-	struct page *page;
-	unsigned char *user_mem, *cmem;
 
-	page = bio->bi_io_vec[0].bv_page;
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+#if defined(CONFIG_RAMZSWAP_STATS)
+/* Tracks a read forwarded to backing swap, to time it */
+struct rzs_bdev_read {
+	struct ramzswap *rzs;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	ktime_t start;
+};
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+static void rzs_bdev_read_end_io(struct bio *bio, int err)
+{
+	unsigned long flags;
+	struct rzs_bdev_read *rd = bio->bi_private;
+	struct ramzswap *rzs = rd->rzs;
+	u64 ns;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), rd->start));
+	spin_lock_irqsave(&rzs->bdev_read_lock, flags);
+	rzs->stats.bdev_read_ns += ns;
+	if (ns > rzs->stats.bdev_read_max_ns)
+		rzs->stats.bdev_read_max_ns = ns;
+	spin_unlock_irqrestore(&rzs->bdev_read_lock, flags);
+
+	bio->bi_end_io = rd->bi_end_io;
+	bio->bi_private = rd->bi_private;
+	kfree(rd);
+
+	bio->bi_end_io(bio, err);
+}
 
-	memcpy(user_mem, cmem, PAGE_SIZE);
-	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
+static void rzs_time_bdev_read(struct ramzswap *rzs, struct bio *bio)
+{
+	struct rzs_bdev_read *rd;
 
-	ramzswap_flush_dcache_page(page);
+	rd = kmalloc(sizeof(*rd), GFP_NOIO);
+	if (!rd)
+		return;
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return 0;
+	rd->rzs = rzs;
+	rd->bi_end_io = bio->bi_end_io;
+	rd->bi_private = bio->bi_private;
+	rd->start = ktime_get();
+	bio->bi_end_io = rzs_bdev_read_end_io;
+	bio->bi_private = rd;
 }
-
+#else
+#define rzs_time_bdev_read(rzs, bio)
+#endif
 
 /*
  * Called when request page is not present in ramzswap.
@@ -727,6 +1588,7 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 		pagenum = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 		bio->bi_sector = map_backing_swap_page(rzs, pagenum)
 					<< SECTORS_PER_PAGE_SHIFT;
+		rzs_time_bdev_read(rzs, bio);
 		return 1;
 	}
 
@@ -745,11 +1607,45 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
+static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
+{
+	u32 index;
+	struct page *page;
+	unsigned char *user_mem, *cmem;
+
+	page = bio->bi_io_vec[0].bv_page;
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	read_lock(&rzs->migrate_lock);
+	/* Written back meanwhile */
+	if (unlikely(!rzs->table[index].page)) {
+		read_unlock(&rzs->migrate_lock);
+		return handle_ramzswap_fault(rzs, bio);
+	}
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
+			rzs->table[index].offset;
+
+	memcpy(user_mem, cmem, PAGE_SIZE);
+	kunmap_atomic(user_mem, KM_USER0);
+	kunmap_atomic(cmem, KM_USER1);
+	read_unlock(&rzs->migrate_lock);
+
+	ramzswap_flush_dcache_page(page);
+
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return 0;
+}
+
 static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
-	int ret;
+	int ret, id;
 	u32 index;
-	size_t clen;
+	unsigned int clen;
+	ktime_t start;
+	struct rzs_stream *zstrm;
 	struct page *page;
 	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem;
@@ -770,22 +1666,46 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		return handle_uncompressed_page(rzs, bio);
 
+	id = rzs_get_backend(rzs, index);
+	zstrm = rzs_get_stream(rzs);
+	start = ktime_get();
+
 	user_mem = kmap_atomic(page, KM_USER0);
 	clen = PAGE_SIZE;
 
+	/*
+	 * Keep compaction from moving the object, and writeback from
+	 * freeing it, while we decompress it.
+	 */
+	read_lock(&rzs->migrate_lock);
+	if (unlikely(!rzs->table[index].page)) {
+		read_unlock(&rzs->migrate_lock);
+		kunmap_atomic(user_mem, KM_USER0);
+		rzs_put_stream(rzs, zstrm);
+		return handle_ramzswap_fault(rzs, bio);
+	}
+	rzs_set_flag(rzs, index, RZS_ACCESSED);
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-	ret = lzo1x_decompress_safe(
+	ret = crypto_comp_decompress(zstrm->tfm[id],
 		cmem + sizeof(*zheader),
 		xv_get_object_size(cmem) - sizeof(*zheader),
 		user_mem, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
+	read_unlock(&rzs->migrate_lock);
+	rzs_put_stream(rzs, zstrm);
+
+	spin_lock(&rzs->stat64_lock);
+	rzs->backends[id].num_decompress++;
+	rzs->backends[id].decompress_ns +=
+		ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock(&rzs->stat64_lock);
 
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		stat64_inc(rzs, &rzs->stats.failed_reads);
@@ -805,20 +1725,20 @@ out:
 
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
-	int ret, fwd_write_request = 0;
-	u32 offset, index;
-	size_t clen;
+	int ret, id, fwd_write_request = 0, shared = 0;
+	u32 offset, index, checksum = 0;
+	unsigned int clen;
+	ktime_t start;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src;
+	struct rzs_stream *zstrm;
 
 	stat64_inc(rzs, &rzs->stats.num_writes);
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
 #ifndef CONFIG_SWAP_FREE_NOTIFY
 	/*
 	 * System swaps to same sector again when the stored page
@@ -829,11 +1749,10 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		ramzswap_free_page(rzs, index);
 #endif
 
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (page_zero_filled(user_mem)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		mutex_lock(&rzs->lock);
 		rzs_set_flag(rzs, index, RZS_ZERO);
 		mutex_unlock(&rzs->lock);
 		stat_inc(&rzs->stats.pages_zero);
@@ -843,21 +1762,35 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		return 0;
 	}
 
+	kunmap_atomic(user_mem, KM_USER0);
+
+	/* Unlocked peek; a page or so over the limit is harmless */
 	if (rzs->backing_swap &&
 		(rzs->stats.compr_size > rzs->memlimit - PAGE_SIZE)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
 		fwd_write_request = 1;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	/* Compress outside of rzs->lock, in a stream of our own */
+	zstrm = rzs_get_stream(rzs);
+	id = rzs->cur_backend;
+	src = zstrm->buffer;
+	clen = 2 * PAGE_SIZE;
+	start = ktime_get();
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_compress(zstrm->tfm[id], user_mem, PAGE_SIZE,
+				src, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+	spin_lock(&rzs->stat64_lock);
+	rzs->backends[id].num_compress++;
+	rzs->backends[id].compress_ns +=
+		ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock(&rzs->stat64_lock);
+
+	if (unlikely(ret)) {
+		rzs_put_stream(rzs, zstrm);
 		pr_err("Compression failed! err=%d\n", ret);
 		stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -865,13 +1798,14 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 
 	/*
 	 * Page is incompressible. Forward it to backing swap
-	 * if present. Otherwise, store it as-is (uncompressed)
+	 * if present, unless the writeback thread can move it
+	 * there later. Otherwise, store it as-is (uncompressed)
 	 * since we do not want to return too many swap write
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
-		if (rzs->backing_swap) {
-			mutex_unlock(&rzs->lock);
+		rzs_put_stream(rzs, zstrm);
+		if (rzs->backing_swap && !rzs->wb_task) {
 			fwd_write_request = 1;
 			goto out;
 		}
@@ -879,27 +1813,39 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			stat64_inc(rzs, &rzs->stats.failed_writes);
 			goto out;
 		}
 
+		mutex_lock(&rzs->lock);
 		offset = 0;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
 		stat_inc(&rzs->stats.pages_expand);
 		rzs->table[index].page = page_store;
+		zstrm = NULL;
 		src = kmap_atomic(page, KM_USER0);
 		goto memstore;
 	}
 
+	checksum = jhash(src, clen, 0);
+
+	mutex_lock(&rzs->lock);
+
+	if (rzs_dedup_find(rzs, index, id, src, clen, checksum)) {
+		rzs_put_stream(rzs, zstrm);
+		shared = 1;
+		goto update_stats;
+	}
+
 	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
 			&rzs->table[index].page, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
 		mutex_unlock(&rzs->lock);
+		rzs_put_stream(rzs, zstrm);
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		stat64_inc(rzs, &rzs->stats.failed_writes);
 		if (rzs->backing_swap)
 			fwd_write_request = 1;
@@ -912,35 +1858,57 @@ memstore:
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
 	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
 		zheader = (struct zobj_header *)cmem;
+		zheader->refcount = 1;
+		zheader->checksum = checksum;
+		/* Back-reference needed for memory defragmentation */
 		zheader->table_idx = index;
 		cmem += sizeof(*zheader);
 	}
-#endif
 
 	memcpy(cmem, src, clen);
 
 	kunmap_atomic(cmem, KM_USER1);
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		kunmap_atomic(src, KM_USER0);
+	if (zstrm) {
+		rzs_put_stream(rzs, zstrm);
+		rzs_dedup_insert(rzs, index, id, checksum);
+	}
 
-	/* Update stats */
-	rzs->stats.compr_size += clen;
+update_stats:
+	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+		rzs_set_backend_flag(rzs, index, id);
+		rzs->backends[id].pages_stored++;
+		if (!shared)
+			rzs->backends[id].compr_size += clen;
+	}
+	if (!shared)
+		rzs->stats.compr_size += clen;
 	stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		stat_inc(&rzs->stats.good_compress);
 
+	rzs_set_flag(rzs, index, RZS_ACCESSED);
+
+	if (!shared && rzs_should_compact(rzs))
+		schedule_work(&rzs->compact_work);
+
 	mutex_unlock(&rzs->lock);
 
+	if (rzs->wb_task && rzs_wb_over(rzs, wb_high_pct))
+		wake_up(&rzs->wb_wait);
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
 	if (fwd_write_request) {
+		/* Don't let a stale copy of this slot overwrite the page */
+		wait_event(rzs->wb_idle, !rzs_wb_in_flight(rzs, index));
+
 		stat64_inc(rzs, &rzs->stats.bdev_num_writes);
 		bio->bi_bdev = rzs->backing_swap;
 #if 0
@@ -1031,7 +1999,11 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 	if (bdev)
 		fsync_bdev(bdev);
 
+	mutex_lock(&rzs->lock);
 	rzs->init_done = 0;
+	mutex_unlock(&rzs->lock);
+	cancel_work_sync(&rzs->compact_work);
+	rzs_stop_writeback(rzs);
 
 	if (rzs->backing_swap && !rzs->num_extents)
 		is_backing_blkdev = 1;
@@ -1039,15 +2011,19 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 
 	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
-
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	rzs_destroy_streams(rzs);
+	rzs->num_streams = 0;
+	memset(rzs->backends, 0, sizeof(rzs->backends));
+	rzs->num_backends = 0;
+	rzs->cur_backend = 0;
+	memset(rzs->compressor, 0, MAX_COMP_NAME_LEN);
+	rzs_destroy_dedup(rzs);
 
 	/* Free all pages that are still in this ramzswap device */
 	for (index = 0; index < num_pages; index++) {
 		struct page *page;
+		struct zobj_header *zheader;
+		u32 refs;
 		u16 offset;
 
 		page = rzs->table[index].page;
@@ -1056,9 +2032,16 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 		if (!page)
 			continue;
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
+		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
 			__free_page(page);
-		else
+			continue;
+		}
+
+		/* Shared objects go with their last reference */
+		zheader = kmap_atomic(page, KM_USER0) + offset;
+		refs = --zheader->refcount;
+		kunmap_atomic(zheader, KM_USER0);
+		if (!refs)
 			xv_free(rzs->mem_pool, page, offset);
 	}
 
@@ -1132,19 +2115,13 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	else
 		ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	strcpy(rzs->backends[0].name, rzs->compressor[0] ?
+			rzs->compressor : default_compressor);
+	rzs->num_backends = 1;
+	rzs->cur_backend = 0;
+	ret = rzs_create_streams(rzs);
+	if (ret)
 		goto fail;
-	}
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 	rzs->table = vmalloc(num_pages * sizeof(*rzs->table));
@@ -1157,6 +2134,12 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	ret = rzs_create_dedup(rzs, num_pages);
+	if (ret) {
+		pr_err("Error allocating dedup index\n");
+		goto fail;
+	}
+
 	map_backing_swap_extents(rzs);
 
 	page = alloc_page(__GFP_ZERO);
@@ -1205,6 +2188,11 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 		max_zpage_size = max_zpage_size_nobdev;
 	pr_debug("Max compressed page size: %u bytes\n", max_zpage_size);
 
+	rzs->next_compact = jiffies;
+
+	if (rzs->backing_swap)
+		rzs_start_writeback(rzs);
+
 	rzs->init_done = 1;
 
 	if (rzs->backing_swap) {
@@ -1307,6 +2295,29 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[MAX_COMP_NAME_LEN];
+
+		if (copy_from_user(name, (void *)arg, _IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[MAX_COMP_NAME_LEN - 1] = '\0';
+		if (!crypto_has_comp(name, 0, 0)) {
+			pr_info("Unknown compressor %s\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		/* Before init, just remember it; after, switch over live */
+		if (!rzs->init_done) {
+			strcpy(rzs->compressor, name);
+			pr_debug("Compressor set to %s\n", name);
+		} else
+			ret = rzs_set_backend(rzs, name);
+		break;
+	}
+
 	case RZSIO_INIT:
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
@@ -1355,7 +2366,17 @@ static int create_device(struct ramzswap *rzs, int device_id)
 	int ret = 0;
 
 	mutex_init(&rzs->lock);
+	mutex_init(&rzs->backend_lock);
 	spin_lock_init(&rzs->stat64_lock);
+	spin_lock_init(&rzs->stream_lock);
+	spin_lock_init(&rzs->dedup_lock);
+	rwlock_init(&rzs->migrate_lock);
+	spin_lock_init(&rzs->bdev_read_lock);
+	init_waitqueue_head(&rzs->wb_wait);
+	init_waitqueue_head(&rzs->wb_idle);
+	INIT_WORK(&rzs->compact_work, ramzswap_compact_work);
+	INIT_LIST_HEAD(&rzs->idle_streams);
+	init_waitqueue_head(&rzs->stream_wait);
 	INIT_LIST_HEAD(&rzs->backing_swap_extent_list);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
@@ -1448,10 +2469,12 @@ static int __init ramzswap_init(void)
 	for (dev_id = 0; dev_id < num_devices; dev_id++) {
 		if (create_device(&devices[dev_id], dev_id)) {
 			ret = -ENOMEM;
-			goto free_devices;
+			goto destroy_devices;
 		}
 	}
 
+	register_shrinker(&ramzswap_shrinker);
+
 	/*
 	 * Initialize the first device (/dev/ramzswap0)
 	 * if parameters are provided
@@ -1491,6 +2514,8 @@ static int __init ramzswap_init(void)
 	return 0;
 
 free_devices:
+	unregister_shrinker(&ramzswap_shrinker);
+destroy_devices:
 	while(dev_id)
 		destroy_device(&devices[--dev_id]);
 unregister:
@@ -1504,6 +2529,8 @@ static void __exit ramzswap_exit(void)
 	int i;
 	struct ramzswap *rzs;
 
+	unregister_shrinker(&ramzswap_shrinker);
+
 	for (i = 0; i < num_devices; i++) {
 		rzs = &devices[i];
 
@@ -17,6 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/crypto.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -30,14 +34,17 @@ static const unsigned max_num_devices = 32;
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation or
- * migrating compressed pages to backing swap disk.
+ * Identical pages share one object: refcount is the number of table
+ * entries pointing to it and checksum locates it in the dedup index.
+ *
+ * table_idx is a back-reference to the table entry which first stored
+ * this object. Compaction uses it to relocate objects that are not
+ * shared.
  */
 struct zobj_header {
-#if 0
+	u32 refcount;
+	u32 checksum;
 	u32 table_idx;
-#endif
 };
 
 /*-- Configurable parameters */
@@ -67,6 +74,27 @@ static const unsigned max_zpage_size_nobdev = PAGE_SIZE / 4 * 3;
  * since otherwise xv_malloc would always return failure.
  */
 
+/*
+ * Compact the memory pool when more than this percentage of it is lost
+ * to fragmentation, emptying pages that are at most compact_max_used
+ * bytes full. Pools smaller than compact_min_pages are left alone.
+ */
+static const unsigned compact_frag_pct = 25;
+static const unsigned compact_max_used = PAGE_SIZE / 4;
+static const unsigned compact_min_pages = 64;
+
+/*
+ * With a backing swap device, the writeback thread starts moving pages
+ * out once compressed data exceeds wb_high_pct of memlimit and stops
+ * below wb_low_pct, in batches of up to RZS_WB_BATCH pages.
+ */
+static const unsigned wb_high_pct = 90;
+static const unsigned wb_low_pct = 75;
+#define RZS_WB_BATCH	32
+
+/* Compressor used when none is set with RZSIO_SET_COMPRESSOR */
+static const char default_compressor[] = "lzo";
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -82,9 +110,22 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page was read or written since the writeback clock last passed */
+	RZS_ACCESSED,
+
+	/* Page is being copied to backing swap */
+	RZS_WRITEBACK,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
+/*
+ * The upper bits of table[page_no].flags record which of the device's
+ * compression backends produced the page.
+ */
+#define RZS_BACKEND_SHIFT	4
+#define RZS_BACKEND_MASK	(0x3 << RZS_BACKEND_SHIFT)
+
 /*-- Data structures */
 
 /*
@@ -111,6 +152,11 @@ struct ramzswap_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
 				 * needed to enforce memlimit */
+	u32 pages_dedup;	/* pages sharing another page's object */
+	u64 dedup_hits;		/* writes that found an identical object */
+	u64 dedup_saved;	/* bytes not stored thanks to sharing */
+	u64 compact_pages;	/* pool pages freed by compaction */
+	u64 compact_moved;	/* objects moved by compaction */
 	/* more stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
 	u64 num_reads;		/* failed + successful */
@@ -125,16 +171,77 @@ struct ramzswap_stats {
 	u32 pages_expand;	/* % of incompressible pages */
 	u64 bdev_num_reads;	/* no. of reads on backing dev */
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	u64 bdev_read_ns;	/* total latency of backing dev reads */
+	u64 bdev_read_max_ns;	/* ... and the worst one */
 #endif
+	u64 wb_pages;		/* pages moved to backing swap */
+	u64 wb_bios;		/* ... in this many bios */
+	u64 stream_waits;	/* stream requests that found all busy */
+	u64 stream_wait_ns;	/* ... and the time spent waiting */
+};
+
+/*
+ * A compression algorithm in use by the device. Pages written with it
+ * stay readable after RZSIO_SET_COMPRESSOR switches to another one.
+ */
+struct rzs_backend {
+	char name[MAX_COMP_NAME_LEN];
+	u64 pages_stored;
+	u64 compr_size;
+	u64 num_compress;	/* compress and decompress counts and times */
+	u64 compress_ns;	/* are protected by stat64_lock */
+	u64 num_decompress;
+	u64 decompress_ns;
+};
+
+/*
+ * Compression workspace. Each device keeps one per online CPU so that
+ * writers can compress pages in parallel; rzs->lock is only taken to
+ * store the result. Readers borrow one to decompress.
+ */
+struct rzs_stream {
+	struct list_head list;
+	void *buffer;
+	struct crypto_comp *tfm[MAX_COMP_BACKENDS];
+};
+
+/*
+ * Index of stored compressed objects, hashed by zobj_header.checksum,
+ * used to find an existing object identical to a newly compressed page.
+ */
+struct rzs_dedup_entry {
+	struct hlist_node node;
+	struct page *page;
+	u32 checksum;
+	u16 offset;
+	u8 backend;
 };
 
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct hlist_head *dedup_table;
+	unsigned int dedup_mask;
+	spinlock_t dedup_lock;	/* protects dedup_table, object refcounts
+				 * and dedup stats */
+	/*
+	 * Held for read while a compressed object is used without
+	 * rzs->lock, for write while compaction moves objects.
+	 */
+	rwlock_t migrate_lock;
+	struct work_struct compact_work;
+	unsigned long next_compact;	/* jiffies */
+	struct list_head idle_streams;
+	spinlock_t stream_lock;	/* protects idle_streams */
+	wait_queue_head_t stream_wait;
+	int num_streams;
+	struct rzs_backend backends[MAX_COMP_BACKENDS];
+	int num_backends;
+	int cur_backend;	/* backend for new pages */
+	struct mutex backend_lock; /* serializes backend changes */
+	char compressor[MAX_COMP_NAME_LEN]; /* requested before init */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	struct mutex lock;	/* protects table, mem_pool and stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -151,6 +258,8 @@ struct ramzswap {
 	size_t disksize;	/* bytes */
 
 	struct ramzswap_stats stats;
+	spinlock_t bdev_read_lock;	/* bdev read latency stats, updated
+					 * from bio completion */
 
 	/* backing swap device info */
 	struct ramzswap_backing_extent *curr_extent;
@@ -159,6 +268,29 @@ struct ramzswap {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
 	struct block_device *backing_swap;
 	struct file *swap_file;
+
+	/* background writeback to backing swap */
+	struct task_struct *wb_task;
+	wait_queue_head_t wb_wait;	/* wb_task sleeps here */
+	wait_queue_head_t wb_idle;	/* forwarded writes wait for a batch */
+	u32 wb_hand;		/* clock hand over the table */
+	u32 wb_first, wb_last;	/* slots of the batch in flight */
+	int wb_active;
+	struct rzs_wb_batch *wb_batch;
+};
+
+/*
+ * A batch of pages on their way to backing swap. Slots stay in memory
+ * until the bios complete; a slot freed meanwhile loses RZS_WRITEBACK
+ * and is left alone.
+ */
+struct rzs_wb_batch {
+	int nr;
+	u32 index[RZS_WB_BATCH];
+	struct page *page[RZS_WB_BATCH];
+	atomic_t pending;
+	int error;
+	struct completion done;
 };
 
 /*-- */
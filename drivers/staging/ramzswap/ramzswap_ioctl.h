@@ -17,6 +17,24 @@
 
 #define MAX_SWAP_NAME_LEN 128
 
+/* Compression algorithms, as named by the crypto API */
+#define MAX_COMP_NAME_LEN	16
+#define MAX_COMP_BACKENDS	4
+
+/* Memory pool occupancy histograms, classes split PAGE_SIZE evenly */
+#define RZS_NR_SIZE_CLASSES	16
+#define RZS_NR_FILL_CLASSES	8
+
+struct ramzswap_ioctl_backend_stats {
+	char name[MAX_COMP_NAME_LEN];	/* empty if slot is unused */
+	u64 pages_stored;	/* pages currently stored with this algorithm */
+	u64 compr_data_size;	/* ... and their compressed size */
+	u64 num_compress;
+	u64 compress_ns;	/* CPU time spent compressing */
+	u64 num_decompress;
+	u64 decompress_ns;	/* CPU time spent decompressing */
+} __attribute__ ((packed, aligned(4)));
+
 struct ramzswap_ioctl_stats {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
 	u64 memlimit;		/* only applicable if backing swap present */
@@ -38,6 +56,23 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 	u64 bdev_num_reads;	/* no. of reads on backing dev */
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	u64 bdev_read_ns;	/* total latency of backing dev reads */
+	u64 bdev_read_max_ns;	/* ... and the worst one */
+	u64 wb_pages;		/* pages moved to backing dev in background */
+	u64 wb_bios;		/* ... in this many bios */
+	u32 pages_dedup;	/* pages sharing an identical page's object */
+	u64 dedup_hits;		/* writes that found an identical object */
+	u64 dedup_saved;	/* compressed bytes saved by sharing */
+	u64 mem_used_objects;	/* part of mem_used_total holding objects */
+	u64 compact_pages;	/* pages freed by compaction */
+	u64 compact_moved;	/* objects moved by compaction */
+	u32 size_hist[RZS_NR_SIZE_CLASSES];	/* objects by size */
+	u32 fill_hist[RZS_NR_FILL_CLASSES];	/* pool pages by occupancy */
+	u32 cur_backend;	/* index of algorithm used for new pages */
+	struct ramzswap_ioctl_backend_stats backends[MAX_COMP_BACKENDS];
+	u32 num_streams;	/* compression streams */
+	u64 stream_waits;	/* stream requests that found all busy */
+	u64 stream_wait_ns;	/* ... and the time spent waiting */
 } __attribute__ ((packed, aligned(4)));
 
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
@@ -46,5 +81,6 @@ struct ramzswap_ioctl_stats {
 #define RZSIO_GET_STATS		_IOR('z', 3, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 4)
 #define RZSIO_RESET		_IO('z', 5)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 6, unsigned char[MAX_COMP_NAME_LEN])
 
 #endif
@@ -14,6 +14,7 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
@@ -63,6 +64,29 @@ static void put_ptr_atomic(void *ptr, enum km_type type)
 	kunmap_atomic(ptr, type);
 }
 
+static u32 size_class(u32 size)
+{
+	return size * XV_NR_SIZE_CLASSES / PAGE_SIZE;
+}
+
+static void account_alloc(struct xv_pool *pool, struct page *page, u32 size)
+{
+	u32 bytes = ALIGN(size, XV_ALIGN) + XV_ALIGN;
+
+	set_page_private(page, page_private(page) + bytes);
+	pool->used_bytes += bytes;
+	pool->size_hist[size_class(size)]++;
+}
+
+static void account_free(struct xv_pool *pool, struct page *page, u32 size)
+{
+	u32 bytes = ALIGN(size, XV_ALIGN) + XV_ALIGN;
+
+	set_page_private(page, page_private(page) - bytes);
+	pool->used_bytes -= bytes;
+	pool->size_hist[size_class(size)]--;
+}
+
 static u32 get_blockprev(struct block_header *block)
 {
 	return block->prev & PREV_MASK;
@@ -284,9 +308,11 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	if (unlikely(!page))
 		return -ENOMEM;
 
-	stat_inc(&pool->total_pages);
+	set_page_private(page, 0);
 
 	spin_lock(&pool->lock);
+	stat_inc(&pool->total_pages);
+	list_add(&page->lru, &pool->page_list);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -317,6 +343,7 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->page_list);
 
 	return pool;
 }
@@ -326,6 +353,53 @@ void xv_destroy_pool(struct xv_pool *pool)
 	kfree(pool);
 }
 
+/*
+ * Allocate 'origsize' bytes from the free block at <page, offset>, the
+ * head of freelist 'index' as returned by find_block(). The remainder,
+ * if any, goes back to the freelists. Called with pool->lock held.
+ */
+static void take_block(struct xv_pool *pool, struct page *page, u32 offset,
+			u32 index, u32 origsize)
+{
+	u32 size, tmpsize, tmpoffset;
+	struct block_header *block, *tmpblock;
+
+	size = ALIGN(origsize, XV_ALIGN);
+	block = get_ptr_atomic(page, offset, KM_USER0);
+
+	remove_block_head(pool, block, index);
+
+	/* Split the block if required */
+	tmpoffset = offset + size + XV_ALIGN;
+	tmpsize = block->size - size;
+	tmpblock = (struct block_header *)((char *)block + size + XV_ALIGN);
+	if (tmpsize) {
+		tmpblock->size = tmpsize - XV_ALIGN;
+		set_flag(tmpblock, BLOCK_FREE);
+		clear_flag(tmpblock, PREV_FREE);
+
+		set_blockprev(tmpblock, offset);
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
+			insert_block(pool, page, tmpoffset, tmpblock);
+
+		if (tmpoffset + XV_ALIGN + tmpblock->size != PAGE_SIZE) {
+			tmpblock = BLOCK_NEXT(tmpblock);
+			set_blockprev(tmpblock, tmpoffset);
+		}
+	} else {
+		/* This block is exact fit */
+		if (tmpoffset != PAGE_SIZE)
+			clear_flag(tmpblock, PREV_FREE);
+	}
+
+	block->size = origsize;
+	clear_flag(block, BLOCK_FREE);
+
+	put_ptr_atomic(block, KM_USER0);
+
+	account_alloc(pool, page, origsize);
+}
+
 /**
  * xv_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
@@ -343,8 +417,7 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 		u32 *offset, gfp_t flags)
 {
 	int error;
-	u32 index, tmpsize, origsize, tmpoffset;
-	struct block_header *block, *tmpblock;
+	u32 index, origsize;
 
 	*page = NULL;
 	*offset = 0;
@@ -376,37 +449,7 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 		return -ENOMEM;
 	}
 
-	block = get_ptr_atomic(*page, *offset, KM_USER0);
-
-	remove_block_head(pool, block, index);
-
-	/* Split the block if required */
-	tmpoffset = *offset + size + XV_ALIGN;
-	tmpsize = block->size - size;
-	tmpblock = (struct block_header *)((char *)block + size + XV_ALIGN);
-	if (tmpsize) {
-		tmpblock->size = tmpsize - XV_ALIGN;
-		set_flag(tmpblock, BLOCK_FREE);
-		clear_flag(tmpblock, PREV_FREE);
-
-		set_blockprev(tmpblock, *offset);
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
-			insert_block(pool, *page, tmpoffset, tmpblock);
-
-		if (tmpoffset + XV_ALIGN + tmpblock->size != PAGE_SIZE) {
-			tmpblock = BLOCK_NEXT(tmpblock);
-			set_blockprev(tmpblock, tmpoffset);
-		}
-	} else {
-		/* This block is exact fit */
-		if (tmpoffset != PAGE_SIZE)
-			clear_flag(tmpblock, PREV_FREE);
-	}
-
-	block->size = origsize;
-	clear_flag(block, BLOCK_FREE);
-
-	put_ptr_atomic(block, KM_USER0);
+	take_block(pool, *page, *offset, index, origsize);
 	spin_unlock(&pool->lock);
 
 	*offset += XV_ALIGN;
@@ -415,23 +458,24 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 }
 
 /*
- * Free block identified with <page, offset>
+ * Free block identified with <page, offset>. Called with pool->lock held.
+ * Returns 1 if this left the page empty; it is then no longer part of the
+ * pool and the caller must free it.
  */
-void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+static int free_block(struct xv_pool *pool, struct page *page, u32 offset)
 {
 	void *page_start;
 	struct block_header *block, *tmpblock;
 
 	offset -= XV_ALIGN;
 
-	spin_lock(&pool->lock);
-
 	page_start = get_ptr_atomic(page, 0, KM_USER0);
 	block = (struct block_header *)((char *)page_start + offset);
 
 	/* Catch double free bugs */
 	BUG_ON(test_flag(block, BLOCK_FREE));
 
+	account_free(pool, page, block->size);
 	block->size = ALIGN(block->size, XV_ALIGN);
 
 	tmpblock = BLOCK_NEXT(block);
@@ -469,11 +513,10 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	/* No used objects in this page. Free it. */
 	if (block->size == PAGE_SIZE - XV_ALIGN) {
 		put_ptr_atomic(page_start, KM_USER0);
-		spin_unlock(&pool->lock);
 
-		__free_page(page);
+		list_del(&page->lru);
 		stat_dec(&pool->total_pages);
-		return;
+		return 1;
 	}
 
 	set_flag(block, BLOCK_FREE);
@@ -487,7 +530,163 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	}
 
 	put_ptr_atomic(page_start, KM_USER0);
+
+	return 0;
+}
+
+void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+{
+	int empty;
+
+	spin_lock(&pool->lock);
+	empty = free_block(pool, page, offset);
+	spin_unlock(&pool->lock);
+
+	if (empty)
+		__free_page(page);
+}
+
+/*
+ * Move every object out of 'page' into free space elsewhere in the pool.
+ * Called with pool->lock held. Returns 1 if the page was emptied and
+ * dropped from the pool; the caller frees it. Otherwise the objects that
+ * did move are released from 'page', which stays in the pool.
+ */
+static int evacuate_page(struct xv_pool *pool, struct page *page,
+			xv_move_fn move, void *private)
+{
+	u32 bit, offset, size, index, new_offset;
+	void *page_start, *src, *dst;
+	struct page *new_page;
+	struct block_header *block;
+	DECLARE_BITMAP(objs, PAGE_SIZE / XV_ALIGN);
+	DECLARE_BITMAP(moved, PAGE_SIZE / XV_ALIGN);
+
+	bitmap_zero(objs, PAGE_SIZE / XV_ALIGN);
+	bitmap_zero(moved, PAGE_SIZE / XV_ALIGN);
+
+	/*
+	 * Note where the objects are and take the page's free blocks off
+	 * the freelists, so that nothing gets moved back into it.
+	 */
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset < PAGE_SIZE; offset += size + XV_ALIGN) {
+		block = (struct block_header *)((char *)page_start + offset);
+		size = ALIGN(block->size, XV_ALIGN);
+		if (!test_flag(block, BLOCK_FREE))
+			__set_bit(offset / XV_ALIGN, objs);
+		else if (block->size >= XV_MIN_ALLOC_SIZE)
+			remove_block(pool, page, offset, block,
+				    get_index_for_insert(block->size));
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	for (bit = find_first_bit(objs, PAGE_SIZE / XV_ALIGN);
+	     bit < PAGE_SIZE / XV_ALIGN;
+	     bit = find_next_bit(objs, PAGE_SIZE / XV_ALIGN, bit + 1)) {
+		offset = bit * XV_ALIGN;
+		block = get_ptr_atomic(page, offset, KM_USER0);
+		size = block->size;
+		put_ptr_atomic(block, KM_USER0);
+
+		new_page = NULL;
+		index = find_block(pool, ALIGN(size, XV_ALIGN),
+				&new_page, &new_offset);
+		if (!new_page)
+			goto undo;
+
+		take_block(pool, new_page, new_offset, index, size);
+		new_offset += XV_ALIGN;
+
+		src = get_ptr_atomic(page, offset + XV_ALIGN, KM_USER0);
+		dst = get_ptr_atomic(new_page, new_offset, KM_USER1);
+		memcpy(dst, src, size);
+		put_ptr_atomic(dst, KM_USER1);
+		put_ptr_atomic(src, KM_USER0);
+
+		if (move(private, page, offset + XV_ALIGN,
+				new_page, new_offset)) {
+			if (free_block(pool, new_page, new_offset))
+				__free_page(new_page);
+			goto undo;
+		}
+		__set_bit(bit, moved);
+	}
+
+	/* Everything moved: drop the page as a whole */
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (bit = find_first_bit(objs, PAGE_SIZE / XV_ALIGN);
+	     bit < PAGE_SIZE / XV_ALIGN;
+	     bit = find_next_bit(objs, PAGE_SIZE / XV_ALIGN, bit + 1)) {
+		block = (struct block_header *)((char *)page_start +
+						bit * XV_ALIGN);
+		account_free(pool, page, block->size);
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	list_del(&page->lru);
+	stat_dec(&pool->total_pages);
+	return 1;
+
+undo:
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset < PAGE_SIZE; offset += size + XV_ALIGN) {
+		block = (struct block_header *)((char *)page_start + offset);
+		size = ALIGN(block->size, XV_ALIGN);
+		if (test_flag(block, BLOCK_FREE) &&
+				block->size >= XV_MIN_ALLOC_SIZE)
+			insert_block(pool, page, offset, block);
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	/*
+	 * The copies are live now. The object left behind keeps any of
+	 * these frees from emptying the page.
+	 */
+	for (bit = find_first_bit(moved, PAGE_SIZE / XV_ALIGN);
+	     bit < PAGE_SIZE / XV_ALIGN;
+	     bit = find_next_bit(moved, PAGE_SIZE / XV_ALIGN, bit + 1))
+		free_block(pool, page, bit * XV_ALIGN + XV_ALIGN);
+
+	return 0;
+}
+
+/**
+ * xv_compact - move objects out of sparsely used pages
+ * @pool: pool to compact
+ * @nr_scan: number of pool pages to look at
+ * @max_used: only empty pages with at most this many bytes allocated
+ * @move: called for each object moved, with pool->lock held
+ * @private: passed to @move
+ *
+ * Pages are scanned round-robin, so repeated calls cover the whole
+ * pool. Objects only move into free space the pool already has; no
+ * pages are allocated. Returns the number of pages freed.
+ */
+int xv_compact(struct xv_pool *pool, u32 nr_scan, u32 max_used,
+		xv_move_fn move, void *private)
+{
+	int freed = 0;
+	struct page *page;
+
+	spin_lock(&pool->lock);
+	while (nr_scan-- && !list_empty(&pool->page_list)) {
+		page = list_first_entry(&pool->page_list, struct page, lru);
+		list_move_tail(&page->lru, &pool->page_list);
+
+		if (page_private(page) > max_used)
+			continue;
+		if (!evacuate_page(pool, page, move, private))
+			continue;
+
+		spin_unlock(&pool->lock);
+		__free_page(page);
+		freed++;
+		spin_lock(&pool->lock);
+	}
 	spin_unlock(&pool->lock);
+
+	return freed;
 }
 
 u32 xv_get_object_size(void *obj)
@@ -505,3 +704,33 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+
+/*
+ * Returns memory taken by allocated objects and their headers. The
+ * difference to xv_get_total_size_bytes() is lost to fragmentation.
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
+
+/*
+ * Fill size_hist with the number of live objects per size class and
+ * fill_hist with the number of pages per occupancy class, each class
+ * covering an equal share of PAGE_SIZE.
+ */
+void xv_get_histograms(struct xv_pool *pool, u32 *size_hist, u32 *fill_hist)
+{
+	u32 class;
+	struct page *page;
+
+	memset(fill_hist, 0, XV_NR_FILL_CLASSES * sizeof(*fill_hist));
+
+	spin_lock(&pool->lock);
+	memcpy(size_hist, pool->size_hist, sizeof(pool->size_hist));
+	list_for_each_entry(page, &pool->page_list, lru) {
+		class = page_private(page) * XV_NR_FILL_CLASSES / PAGE_SIZE;
+		fill_hist[min_t(u32, class, XV_NR_FILL_CLASSES - 1)]++;
+	}
+	spin_unlock(&pool->lock);
+}
@@ -15,8 +15,21 @@
 
 #include <linux/types.h>
 
+struct page;
 struct xv_pool;
 
+/* Granularity of the occupancy histograms from xv_get_histograms() */
+#define XV_NR_SIZE_CLASSES	16
+#define XV_NR_FILL_CLASSES	8
+
+/*
+ * Called by xv_compact() after an object was copied to <new_page,
+ * new_offset>. Must point the object's owner at the new location and
+ * return 0, or return non-zero to leave the object where it is.
+ */
+typedef int (*xv_move_fn)(void *private, struct page *page, u32 offset,
+			struct page *new_page, u32 new_offset);
+
 struct xv_pool *xv_create_pool(void);
 void xv_destroy_pool(struct xv_pool *pool);
 
@@ -26,5 +39,10 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+void xv_get_histograms(struct xv_pool *pool, u32 *size_hist, u32 *fill_hist);
+
+int xv_compact(struct xv_pool *pool, u32 nr_scan, u32 max_used,
+			xv_move_fn move, void *private);
 
 #endif
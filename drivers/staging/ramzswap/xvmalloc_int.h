@@ -14,6 +14,7 @@
 #define _XV_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 /* User configurable params */
@@ -79,8 +80,16 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	/*
+	 * All pages of the pool, linked through page->lru. page_private()
+	 * holds the bytes allocated from each, block headers included.
+	 */
+	struct list_head page_list;
+
 	/* stats */
 	u64 total_pages;
+	u64 used_bytes;
+	u32 size_hist[XV_NR_SIZE_CLASSES];	/* live objects by size */
 };
 
 #endif
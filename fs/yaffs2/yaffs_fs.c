@@ -51,6 +51,8 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 
 #include "asm/div64.h"
 
@@ -122,15 +124,52 @@ unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 
+/* Background GC: once writes have stopped for bg_gc_idle_ms, collect blocks
+ * with at most bg_gc_max_live_pct of their pages in use until there are
+ * bg_gc_erased erased blocks beyond the reserve. 0 erased disables it.
+ */
+unsigned int yaffs_bg_gc_erased = 8;
+unsigned int yaffs_bg_gc_idle_ms = 500;
+unsigned int yaffs_bg_gc_max_live_pct = 50;
+
+/* Rewrite the checkpoint once the fs has been idle this long, so that an
+ * unclean shutdown doesn't force a full scan at the next mount. 0 disables.
+ * Each rewrite erases the checkpoint blocks, so it is done at most once per
+ * bg_checkpoint_interval_ms.
+ */
+unsigned int yaffs_bg_checkpoint_idle_ms = 30000;
+unsigned int yaffs_bg_checkpoint_interval_ms = 600000;
+
+/* Chunk cache size per mount; 0 sizes it from the number of blocks.
+ * readahead_chunks is how many chunks to load ahead of a sequential
+ * reader, 0 disables it (the page cache already reads ahead for us).
+ */
+unsigned int yaffs_cache_chunks;
+unsigned int yaffs_readahead_chunks;
+
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_gc_erased, uint, 0644);
+module_param(yaffs_bg_gc_idle_ms, uint, 0644);
+module_param(yaffs_bg_gc_max_live_pct, uint, 0644);
+module_param(yaffs_bg_checkpoint_idle_ms, uint, 0644);
+module_param(yaffs_bg_checkpoint_interval_ms, uint, 0644);
+module_param(yaffs_cache_chunks, uint, 0644);
+module_param(yaffs_readahead_chunks, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_bg_gc_erased, "i");
+MODULE_PARM(yaffs_bg_gc_idle_ms, "i");
+MODULE_PARM(yaffs_bg_gc_max_live_pct, "i");
+MODULE_PARM(yaffs_bg_checkpoint_idle_ms, "i");
+MODULE_PARM(yaffs_bg_checkpoint_interval_ms, "i");
+MODULE_PARM(yaffs_cache_chunks, "i");
+MODULE_PARM(yaffs_readahead_chunks, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -220,6 +259,8 @@ static int yaffs_sync_fs(struct super_block *sb);
 static int yaffs_write_super(struct super_block *sb);
 #endif
 
+static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data);
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf);
 #elif (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -362,19 +403,73 @@ static const struct super_operations yaffs_super_ops = {
 	.clear_inode = yaffs_clear_inode,
 	.sync_fs = yaffs_sync_fs,
 	.write_super = yaffs_write_super,
+	.remount_fs = yaffs_remount_fs,
 };
 
+/* Count gross lock acquisitions that had to wait, and for how long */
+static void yaffs_GrossLockWaited(yaffs_Device *dev, int shared,
+				  ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&dev->lockStatLock);
+	dev->grossLockWaits[shared]++;
+	dev->grossLockWaitUs[shared] += us;
+	spin_unlock(&dev->lockStatLock);
+}
+
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
-	down(&dev->grossLock);
+	if (!down_write_trylock(&dev->grossLock)) {
+		ktime_t start = ktime_get();
+
+		down_write(&dev->grossLock);
+		yaffs_GrossLockWaited(dev, 0, start);
+	}
+	dev->lastActivity = jiffies;
+	dev->wasCheckpointed = dev->isCheckpointed;
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
+	/* Wake the background thread if erased blocks run low, or if we
+	 * just made the checkpoint stale and it has to schedule a rewrite.
+	 */
+	int wake = dev->nErasedBlocks <
+			dev->nReservedBlocks + yaffs_bg_gc_erased ||
+		   (dev->wasCheckpointed && !dev->isCheckpointed);
+
 	T(YAFFS_TRACE_OS, ("yaffs unlocking %p\n", current));
-	up(&dev->grossLock);
+	up_write(&dev->grossLock);
+
+	if (wake && dev->bgGcThread) {
+		dev->bgGcWake = 1;
+		wake_up(&dev->bgGcWait);
+	}
+}
+
+/* Shared lock for paths that only read the file system. They may run
+ * together; the bits of guts state they update are serialized by the
+ * narrower reader, nand and temp buffer locks (see yportenv.h).
+ */
+static void yaffs_GrossReadLock(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs read locking %p\n", current));
+	if (!down_read_trylock(&dev->grossLock)) {
+		ktime_t start = ktime_get();
+
+		down_read(&dev->grossLock);
+		yaffs_GrossLockWaited(dev, 1, start);
+	}
+	T(YAFFS_TRACE_OS, ("yaffs read locked %p\n", current));
+}
+
+static void yaffs_GrossReadUnlock(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs read unlocking %p\n", current));
+	up_read(&dev->grossLock);
 }
 
 static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
@@ -385,11 +480,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
 
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -409,11 +504,11 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret;
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (!alias) {
 		ret = -ENOMEM;
@@ -449,7 +544,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
@@ -461,7 +556,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -623,13 +718,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	ret = yaffs_ReadDataFromFile(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1137,7 +1232,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossReadLock(dev);
 
 	offset = f->f_pos;
 
@@ -1200,7 +1295,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 
 up_and_out:
 out:
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossReadUnlock(dev);
 
 	return 0;
 }
@@ -1709,7 +1804,9 @@ static void yaffs_read_inode(struct inode *inode)
 
 static YLIST_HEAD(yaffs_dev_list);
 
-#if 0 /* not used */
+static void yaffs_StartBackgroundGC(yaffs_Device *dev);
+static void yaffs_StopBackgroundGC(yaffs_Device *dev);
+
 static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 {
 	yaffs_Device    *dev = yaffs_SuperToDevice(sb);
@@ -1720,6 +1817,8 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RO\n", dev->name));
 
+		yaffs_StopBackgroundGC(dev);
+
 		yaffs_GrossLock(dev);
 
 		yaffs_FlushEntireDeviceCache(dev);
@@ -1733,11 +1832,130 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 	} else {
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RW\n", dev->name));
+
+		yaffs_StartBackgroundGC(dev);
 	}
 
 	return 0;
 }
-#endif
+
+/* Rewrite a stale checkpoint once the fs has been idle for
+ * bg_checkpoint_idle_ms, but not within bg_checkpoint_interval_ms of the
+ * last background rewrite. Returns how long to sleep before looking again.
+ */
+static long yaffs_BackgroundCheckpoint(yaffs_Device *dev)
+{
+	long wait;
+	long due;
+
+	if (!yaffs_auto_checkpoint || !yaffs_bg_checkpoint_idle_ms ||
+	    dev->isCheckpointed || dev->skipCheckpointWrite ||
+	    (((struct super_block *)dev->superBlock)->s_flags & MS_RDONLY))
+		return MAX_SCHEDULE_TIMEOUT;
+
+	wait = (long)(dev->lastActivity +
+		      msecs_to_jiffies(yaffs_bg_checkpoint_idle_ms) - jiffies);
+	due = (long)(dev->lastBgCheckpoint +
+		     msecs_to_jiffies(yaffs_bg_checkpoint_interval_ms) - jiffies);
+	if (due > wait)
+		wait = due;
+	if (wait > 0)
+		return wait;
+
+	if (!down_write_trylock(&dev->grossLock))
+		return HZ;
+
+	T(YAFFS_TRACE_CHECKPOINT,
+	  ("yaffs: background checkpoint for %s\n", dev->name));
+	yaffs_FlushEntireDeviceCache(dev);
+	yaffs_CheckpointSave(dev);
+	dev->lastBgCheckpoint = jiffies;
+	up_write(&dev->grossLock);
+
+	return MAX_SCHEDULE_TIMEOUT;
+}
+
+/* Background garbage collector, one per writable mount.
+ * Sleeps until writes have been idle for yaffs_bg_gc_idle_ms, then does GC
+ * a step at a time, dropping the gross lock between steps. When there is
+ * nothing left to collect it sleeps until a writer runs the erased blocks
+ * low or makes the checkpoint stale, or a checkpoint rewrite is due. It only
+ * ever trylocks so it never makes a file system operation wait behind it.
+ */
+static int yaffs_BackgroundGC(void *data)
+{
+	yaffs_Device *dev = data;
+
+	T(YAFFS_TRACE_GC, ("yaffs_BackgroundGC starting for %s\n", dev->name));
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		unsigned long idle = msecs_to_jiffies(yaffs_bg_gc_idle_ms);
+		long wait = (long)(dev->lastActivity + idle - jiffies);
+		int didWork = 0;
+
+		if (wait > 0) {
+			wait_event_freezable_timeout(dev->bgGcWait,
+				kthread_should_stop(), wait);
+			continue;
+		}
+
+		/* Clear before looking, so a writer's wake isn't lost */
+		dev->bgGcWake = 0;
+		smp_mb();
+
+		if (yaffs_bg_gc_erased &&
+		    !(((struct super_block *)dev->superBlock)->s_flags &
+		      MS_RDONLY) &&
+		    down_write_trylock(&dev->grossLock)) {
+			didWork = yaffs_BackgroundGarbageCollect(dev,
+				dev->nReservedBlocks + yaffs_bg_gc_erased,
+				dev->nChunksPerBlock *
+					yaffs_bg_gc_max_live_pct / 100);
+			up_write(&dev->grossLock);
+		}
+
+		if (didWork)
+			cond_resched();
+		else
+			wait_event_freezable_timeout(dev->bgGcWait,
+				dev->bgGcWake || kthread_should_stop(),
+				yaffs_BackgroundCheckpoint(dev));
+	}
+
+	return 0;
+}
+
+static void yaffs_StartBackgroundGC(yaffs_Device *dev)
+{
+	struct task_struct *t;
+
+	if (dev->bgGcThread)
+		return;
+
+	/* Allow a background checkpoint as soon as the fs goes idle */
+	dev->lastBgCheckpoint = jiffies -
+		msecs_to_jiffies(yaffs_bg_checkpoint_interval_ms);
+	dev->bgGcWake = 0;
+
+	t = kthread_run(yaffs_BackgroundGC, dev, "yaffs-gc-%s", dev->name);
+	if (IS_ERR(t)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: could not start background GC for %s\n",
+		   dev->name));
+		return;
+	}
+	dev->bgGcThread = t;
+}
+
+static void yaffs_StopBackgroundGC(yaffs_Device *dev)
+{
+	if (dev->bgGcThread) {
+		kthread_stop(dev->bgGcThread);
+		dev->bgGcThread = NULL;
+	}
+}
 
 static void yaffs_put_super(struct super_block *sb)
 {
@@ -1745,6 +1963,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_StopBackgroundGC(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -1868,6 +2088,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	struct mtd_info *mtd;
 	int err;
 	char *data_str = (char *)data;
+	unsigned long mountStart;
 
 	yaffs_options options;
 
@@ -2057,7 +2278,6 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	dev->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	dev->nReservedBlocks = 5;
-	dev->nShortOpCaches = (options.no_cache) ? 0 : 10;
 	dev->inbandTags = options.inband_tags;
 #ifdef CONFIG_YAFFS_DOES_TAGS_ECC
 	dev->doesTagsEcc = !options.tags_ecc_off;
@@ -2073,6 +2293,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_ReadChunkWithTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
+		dev->readBlockTagsFromNAND = nandmtd2_ReadBlockTagsFromNAND;
 		dev->spareBuffer = YMALLOC(mtd->oobsize);
 		dev->isYaffs2 = 1;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -2101,6 +2322,16 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 #endif
 		dev->isYaffs2 = 0;
 	}
+
+	/* One cache chunk per 32 blocks, but at least the old 10 */
+	if (options.no_cache)
+		dev->nShortOpCaches = 0;
+	else if (yaffs_cache_chunks)
+		dev->nShortOpCaches = yaffs_cache_chunks;
+	else
+		dev->nShortOpCaches = clamp(nBlocks / 32, 10, 64);
+	dev->nReadAheadChunks = yaffs_readahead_chunks;
+
 	/* ... and common functions */
 	dev->eraseBlockInNAND = nandmtd_EraseBlockInNAND;
 	dev->initialiseNAND = nandmtd_InitialiseNAND;
@@ -2125,15 +2356,22 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	/* we assume this is protected by lock_kernel() in mount/umount */
 	ylist_add_tail(&dev->devList, &yaffs_dev_list);
 
-	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->grossLock);
+	init_waitqueue_head(&dev->bgGcWait);
+	mutex_init(&dev->readerLock);
+	mutex_init(&dev->nandLock);
+	spin_lock_init(&dev->tempLock);
+	spin_lock_init(&dev->lockStatLock);
 
 	yaffs_GrossLock(dev);
 
+	mountStart = jiffies;
 	err = yaffs_GutsInitialise(dev);
 
 	T(YAFFS_TRACE_OS,
-	  ("yaffs_read_super: guts initialised %s\n",
-	   (err == YAFFS_OK) ? "OK" : "FAILED"));
+	  ("yaffs_read_super: guts initialised %s in %u ms\n",
+	   (err == YAFFS_OK) ? "OK" : "FAILED",
+	   jiffies_to_msecs(jiffies - mountStart)));
 
 	/* Release lock before yaffs_get_inode() */
 	yaffs_GrossUnlock(dev);
@@ -2164,6 +2402,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	if (!(sb->s_flags & MS_RDONLY))
+		yaffs_StartBackgroundGC(dev);
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2288,7 +2529,18 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
+	buf += sprintf(buf, "gcUs............... %llu\n", dev->gcUs);
+	buf += sprintf(buf, "gcMaxUs............ %u\n", dev->gcMaxUs);
+	buf += sprintf(buf, "backgroundGcUs..... %llu\n", dev->backgroundGcUs);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
+	buf += sprintf(buf, "writeLockWaits..... %d\n", dev->grossLockWaits[0]);
+	buf += sprintf(buf, "writeLockWaitUs.... %llu\n",
+		    dev->grossLockWaitUs[0]);
+	buf += sprintf(buf, "readLockWaits...... %d\n", dev->grossLockWaits[1]);
+	buf += sprintf(buf, "readLockWaitUs..... %llu\n",
+		    dev->grossLockWaitUs[1]);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
 	buf += sprintf(buf, "eccFixed........... %d\n", dev->eccFixed);
@@ -2296,6 +2548,14 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %d\n", dev->cacheMisses);
+	buf += sprintf(buf, "nameLookups........ %d\n", dev->nNameLookups);
+	buf += sprintf(buf, "hashedLookups...... %d\n",
+		    dev->nHashedNameLookups);
+	buf += sprintf(buf, "lookupScans........ %llu\n",
+		    dev->nNameLookupScans);
+	buf += sprintf(buf, "readAheadChunks.... %d\n", dev->readAheadChunks);
+	buf += sprintf(buf, "readAheadHits...... %d\n", dev->readAheadHits);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
@@ -69,6 +69,8 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 static int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name,
 				int force, int isShrink, int shadows);
 static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj);
+static void yaffs_DropDirHash(yaffs_Object *directory);
+static void yaffs_DirHashRemove(yaffs_Object *obj);
 static int yaffs_CheckStructures(void);
 static int yaffs_DeleteWorker(yaffs_Object *in, yaffs_Tnode *tn, __u32 level,
 			int chunkOffset, int *limit);
@@ -213,6 +215,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 {
 	int i, j;
 
+	YTEMP_LOCK(dev);
+
 	dev->tempInUse++;
 	if (dev->tempInUse > dev->maxTemp)
 		dev->maxTemp = dev->tempInUse;
@@ -227,10 +231,14 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 					    dev->tempBuffer[j].line;
 			}
 
+			YTEMP_UNLOCK(dev);
 			return dev->tempBuffer[i].buffer;
 		}
 	}
 
+	dev->unmanagedTempAllocations++;
+	YTEMP_UNLOCK(dev);
+
 	T(YAFFS_TRACE_BUFFERS,
 	  (TSTR("Out of temp buffers at line %d, other held by lines:"),
 	   lineNo));
@@ -244,7 +252,6 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 	 * This is not good.
 	 */
 
-	dev->unmanagedTempAllocations++;
 	return YMALLOC(dev->nDataBytesPerChunk);
 
 }
@@ -254,22 +261,28 @@ void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer,
 {
 	int i;
 
+	YTEMP_LOCK(dev);
+
 	dev->tempInUse--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->tempBuffer[i].buffer == buffer) {
 			dev->tempBuffer[i].line = 0;
+			YTEMP_UNLOCK(dev);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanagedTempDeallocations++;
+	YTEMP_UNLOCK(dev);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		T(YAFFS_TRACE_BUFFERS,
 		  (TSTR("Releasing unmanaged temp buffer in line %d" TENDSTR),
 		   lineNo));
 		YFREE(buffer);
-		dev->unmanagedTempDeallocations++;
 	}
 
 }
@@ -1921,6 +1934,7 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(tn->hardLinks));
 		YINIT_LIST_HEAD(&(tn->hashLink));
 		YINIT_LIST_HEAD(&tn->siblings);
+		YINIT_LIST_HEAD(&tn->dirHashLink);
 
 
 		/* Now make the directory sane */
@@ -1992,6 +2006,8 @@ static void yaffs_FreeObject(yaffs_Object *tn)
 	if (!ylist_empty(&tn->siblings))
 		YBUG();
 
+	if (tn->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_DropDirHash(tn);
 
 #ifdef __KERNEL__
 	if (tn->myInode) {
@@ -2028,9 +2044,21 @@ void yaffs_HandleDeferedFree(yaffs_Object *obj)
 
 static void yaffs_DeinitialiseObjects(yaffs_Device *dev)
 {
-	/* Free the list of allocated Objects */
-
 	yaffs_ObjectList *tmp;
+	yaffs_Object *obj;
+	struct ylist_head *j;
+	int i;
+
+	/* Free any directory name indexes */
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(j, &dev->objectBucket[i].list) {
+			obj = ylist_entry(j, yaffs_Object, hashLink);
+			if (obj->variantType == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_DropDirHash(obj);
+		}
+	}
+
+	/* Free the list of allocated Objects */
 
 	while (dev->allocatedObjectList) {
 		tmp = dev->allocatedObjectList->next;
@@ -2207,10 +2235,12 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 			theObject->variant.fileVariant.shrinkSize = 0xFFFFFFFF;	/* max __u32 */
 			theObject->variant.fileVariant.topLevel = 0;
 			theObject->variant.fileVariant.top = tn;
+			theObject->variant.fileVariant.nextReadChunk = 0;
 			break;
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
 			YINIT_LIST_HEAD(&theObject->variant.directoryVariant.
 					children);
+			theObject->variant.directoryVariant.hash = NULL;
 			break;
 		case YAFFS_OBJECT_TYPE_SYMLINK:
 		case YAFFS_OBJECT_TYPE_HARDLINK:
@@ -3246,6 +3276,8 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 		block = dev->gcBlock;
 
 		if (block > 0) {
+			unsigned us;
+
 			dev->garbageCollections++;
 			if (!aggressive)
 				dev->passiveGarbageCollections++;
@@ -3255,7 +3287,12 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			   ("yaffs: GC erasedBlocks %d aggressive %d" TENDSTR),
 			   dev->nErasedBlocks, aggressive));
 
+			us = Y_CLOCK_US();
 			gcOk = yaffs_GarbageCollectBlock(dev, block, aggressive);
+			us = Y_CLOCK_US() - us;
+			dev->gcUs += us;
+			if (us > dev->gcMaxUs)
+				dev->gcMaxUs = us;
 		}
 
 		if (dev->nErasedBlocks < (dev->nReservedBlocks) && block > 0) {
@@ -3271,6 +3308,49 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* Background garbage collection.
+ * Called by the OS layer while the device is idle, so that writes find
+ * erased blocks waiting instead of collecting them inline.
+ * Does a bounded step of GC on one block whenever fewer than minErased
+ * blocks are erased, and only picks blocks with at most maxLive pages
+ * still in use so that idle time isn't spent copying nearly full blocks.
+ * Returns 1 if it did some work, 0 if there was nothing worth doing.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int minErased,
+				   int maxLive)
+{
+	yaffs_BlockInfo *bi;
+	int block;
+	unsigned us;
+
+	if (dev->isDoingGC || dev->nErasedBlocks >= minErased)
+		return 0;
+
+	if (dev->gcBlock <= 0) {
+		block = yaffs_FindBlockForGarbageCollection(dev, 1);
+		if (block <= 0)
+			return 0;
+
+		bi = yaffs_GetBlockInfo(dev, block);
+		if (bi->pagesInUse - bi->softDeletions > maxLive)
+			return 0;
+
+		dev->gcBlock = block;
+		dev->gcChunk = 0;
+	}
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC erasedBlocks %d block %d" TENDSTR),
+	   dev->nErasedBlocks, dev->gcBlock));
+
+	dev->backgroundGarbageCollections++;
+	us = Y_CLOCK_US();
+	yaffs_GarbageCollectBlock(dev, dev->gcBlock, 0);
+	dev->backgroundGcUs += Y_CLOCK_US() - us;
+
+	return 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3838,10 +3918,39 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The cache is sized at mount time. Chunks are found through a small hash on
+ *   (object, chunkId) and recycled in LRU order from dev->srCacheLru, which
+ *   keeps empty chunks at the front.
  */
 
+static int yaffs_CacheHash(yaffs_Device *dev, const yaffs_Object *obj,
+			   int chunkId)
+{
+	return (obj->objectId * 7 + chunkId) & (dev->srCacheBuckets - 1);
+}
+
+/* Give a cache chunk a new owner */
+static void yaffs_AttachChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				   yaffs_Object *obj, int chunkId)
+{
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->readAhead = 0;
+	ylist_del_init(&cache->hashLink);
+	ylist_add(&cache->hashLink,
+		  &dev->srCacheBucket[yaffs_CacheHash(dev, obj, chunkId)]);
+}
+
+/* Empty a cache chunk and put it first in line for reuse */
+static void yaffs_DetachChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	cache->object = NULL;
+	cache->readAhead = 0;
+	ylist_del_init(&cache->hashLink);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheLru);
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
@@ -3896,7 +4005,7 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 								 cache->nBytes,
 								 1);
 				cache->dirty = 0;
-				cache->object = NULL;
+				yaffs_DetachChunkCache(dev, cache);
 			}
 
 		} while (cache && chunkWritten > 0);
@@ -3948,13 +4057,14 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
  */
 static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 {
-	int i;
+	yaffs_ChunkCache *cache;
 
 	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
+		/* Empty chunks are kept at the front of the LRU list */
+		cache = ylist_entry(dev->srCacheLru.next, yaffs_ChunkCache,
+				    lruLink);
+		if (!cache->object)
+			return cache;
 	}
 
 	return NULL;
@@ -3963,44 +4073,28 @@ static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 {
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
+	struct ylist_head *i;
 
 	if (dev->nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
+		/* Try find an empty one... */
 
 		cache = yaffs_GrabChunkCacheWorker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
+			/* They were all in use, take the least recently used one.
+			 * If it is dirty, flush its object's cache and find again.
+			 * With locking we can't assume we can use the first one.
 			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
+			ylist_for_each(i, &dev->srCacheLru) {
+				cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+				if (!cache->locked)
+					break;
+				cache = NULL;
 			}
 
-			if (!cache || cache->dirty) {
+			if (cache && cache->dirty) {
 				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
+				yaffs_FlushFilesChunkCache(cache->object);
 				cache = yaffs_GrabChunkCacheWorker(dev);
 			}
 
@@ -4011,20 +4105,38 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 
 }
 
+/* Grab a cache chunk for a reader: an empty one or the least recently used
+ * clean one. Never flushes, since readers may share the device and must
+ * not write. Returns NULL if every chunk is dirty or locked.
+ */
+static yaffs_ChunkCache *yaffs_GrabCleanChunkCache(yaffs_Device *dev)
+{
+	yaffs_ChunkCache *cache;
+	struct ylist_head *i;
+
+	ylist_for_each(i, &dev->srCacheLru) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (!cache->object || (!cache->dirty && !cache->locked))
+			return cache;
+	}
+	return NULL;
+}
+
 /* Find a cached chunk */
 static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	yaffs_ChunkCache *cache;
+	struct ylist_head *i;
 
-				return &dev->srCache[i];
-			}
+	if (dev->nShortOpCaches > 0) {
+		ylist_for_each(i, &dev->srCacheBucket[yaffs_CacheHash(dev, obj,
+								      chunkId)]) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
 		}
 	}
 	return NULL;
@@ -4036,18 +4148,8 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 {
 
 	if (dev->nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
+		ylist_del(&cache->lruLink);
+		ylist_add_tail(&cache->lruLink, &dev->srCacheLru);
 
 		if (isAWrite)
 			cache->dirty = 1;
@@ -4064,7 +4166,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_DetachChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4080,11 +4182,54 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->nShortOpCaches; i++) {
 			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+				yaffs_DetachChunkCache(dev, &dev->srCache[i]);
 		}
 	}
 }
 
+/* A reader has moved on to the next chunk of the file: load the few after
+ * it into clean cache chunks, so that it finds them there. Called with the
+ * reader lock held.
+ */
+static void yaffs_ReadAheadChunks(yaffs_Object *in, int chunk)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_ChunkCache *cache;
+	int lastChunk;
+	__u32 start;
+	int i;
+
+	if (dev->nShortOpCaches <= 0 || dev->nReadAheadChunks <= 0 ||
+	    in->variantType != YAFFS_OBJECT_TYPE_FILE)
+		return;
+
+	/* Don't read beyond the end of the file */
+	yaffs_AddrToChunk(dev, in->variant.fileVariant.fileSize,
+			  &lastChunk, &start);
+	if (start)
+		lastChunk++;
+
+	for (i = chunk + 1;
+	     i <= chunk + dev->nReadAheadChunks && i <= lastChunk; i++) {
+		if (yaffs_FindChunkCache(in, i))
+			continue;
+
+		cache = yaffs_GrabCleanChunkCache(dev);
+		if (!cache)
+			break;
+
+		yaffs_AttachChunkCache(dev, cache, in, i);
+		cache->dirty = 0;
+		cache->locked = 0;
+		cache->nBytes = 0;
+		yaffs_ReadChunkDataFromObject(in, i, cache->data);
+		cache->readAhead = 1;
+		yaffs_UseChunkCache(dev, cache, 0);
+
+		dev->readAheadChunks++;
+	}
+}
+
 /*--------------------- Checkpointing --------------------*/
 
 
@@ -4670,6 +4815,7 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	int nToCopy;
 	int n = nBytes;
 	int nDone = 0;
+	int readAhead;
 	yaffs_ChunkCache *cache;
 
 	yaffs_Device *dev;
@@ -4690,59 +4836,82 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		else
 			nToCopy = dev->nDataBytesPerChunk - start;
 
+		/* Other readers may be using the cache at the same time */
+		YREADER_LOCK(dev);
+
+		/* Read ahead when a reader moves on to the next chunk */
+		readAhead = (in->variant.fileVariant.nextReadChunk == chunk);
+		in->variant.fileVariant.nextReadChunk = chunk + 1;
+
 		cache = yaffs_FindChunkCache(in, chunk);
+		if (cache) {
+			dev->cacheHits++;
+			if (cache->readAhead) {
+				dev->readAheadHits++;
+				cache->readAhead = 0;
+			}
+		} else
+			dev->cacheMisses++;
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
 		 * else bypass the cache.
+		 * Only clean chunks are recycled here; if they are all dirty the
+		 * read goes through a temp buffer instead of flushing.
 		 */
-		if (cache || nToCopy != dev->nDataBytesPerChunk || dev->inbandTags) {
-			if (dev->nShortOpCaches > 0) {
+		if (!cache && dev->nShortOpCaches > 0 &&
+		    (nToCopy != dev->nDataBytesPerChunk || dev->inbandTags)) {
+			/* If we can't find the data in the cache, then load it up. */
+			cache = yaffs_GrabCleanChunkCache(dev);
+			if (cache) {
+				yaffs_AttachChunkCache(dev, cache, in, chunk);
+				cache->dirty = 0;
+				cache->locked = 0;
+				yaffs_ReadChunkDataFromObject(in, chunk,
+							      cache->data);
+				cache->nBytes = 0;
+			}
+		}
 
-				/* If we can't find the data in the cache, then load it up. */
+		if (cache) {
+			yaffs_UseChunkCache(dev, cache, 0);
 
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
-					cache->nBytes = 0;
-				}
+			cache->locked = 1;
 
-				yaffs_UseChunkCache(dev, cache, 0);
 
-				cache->locked = 1;
+			memcpy(buffer, &cache->data[start], nToCopy);
 
+			cache->locked = 0;
 
-				memcpy(buffer, &cache->data[start], nToCopy);
+			YREADER_UNLOCK(dev);
+		} else if (nToCopy != dev->nDataBytesPerChunk || dev->inbandTags) {
+			/* Read into the local buffer then copy..*/
 
-				cache->locked = 0;
-			} else {
-				/* Read into the local buffer then copy..*/
+			__u8 *localBuffer;
 
-				__u8 *localBuffer =
-				    yaffs_GetTempBuffer(dev, __LINE__);
-				yaffs_ReadChunkDataFromObject(in, chunk,
-							      localBuffer);
+			YREADER_UNLOCK(dev);
 
-				memcpy(buffer, &localBuffer[start], nToCopy);
+			localBuffer = yaffs_GetTempBuffer(dev, __LINE__);
+			yaffs_ReadChunkDataFromObject(in, chunk, localBuffer);
 
+			memcpy(buffer, &localBuffer[start], nToCopy);
 
-				yaffs_ReleaseTempBuffer(dev, localBuffer,
-							__LINE__);
-			}
 
+			yaffs_ReleaseTempBuffer(dev, localBuffer, __LINE__);
 		} else {
+			YREADER_UNLOCK(dev);
 
 			/* A full chunk. Read directly into the supplied buffer. */
 			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
 
 		}
 
+		if (readAhead) {
+			YREADER_LOCK(dev);
+			yaffs_ReadAheadChunks(in, chunk);
+			YREADER_UNLOCK(dev);
+		}
+
 		n -= nToCopy;
 		offset += nToCopy;
 		buffer += nToCopy;
@@ -4828,13 +4997,16 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				yaffs_ChunkCache *cache;
 				/* If we can't find the data in the cache, then load the cache */
 				cache = yaffs_FindChunkCache(in, chunk);
+				if (cache)
+					dev->cacheHits++;
+				else
+					dev->cacheMisses++;
 
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
+					yaffs_AttachChunkCache(dev, cache, in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
@@ -5274,6 +5446,7 @@ static int yaffs_UnlinkWorker(yaffs_Object *obj)
 		hl = ylist_entry(obj->hardLinks.next, yaffs_Object, hardLinks);
 
 		ylist_del_init(&hl->hardLinks);
+		yaffs_DirHashRemove(hl);
 		ylist_del_init(&hl->siblings);
 
 		yaffs_GetObjectName(hl, name, YAFFS_MAX_NAME_LENGTH + 1);
@@ -5875,6 +6048,8 @@ static int yaffs_Scan(yaffs_Device *dev)
 						YINIT_LIST_HEAD(&parent->variant.
 								directoryVariant.
 								children);
+						parent->variant.directoryVariant.
+							hash = NULL;
 					} else if (!parent || parent->variantType !=
 						   YAFFS_OBJECT_TYPE_DIRECTORY) {
 						/* Hoosterman, another problem....
@@ -6027,8 +6202,16 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		in->lazyLoaded ? "not yet" : "already"));
 #endif
 
+	if (!in->lazyLoaded) {
+		/* Pairs with YWMB() below: see the details, not just the flag */
+		YRMB();
+		return;
+	}
+
+	/* Readers sharing the device may race to load the same object */
+	YREADER_LOCK(dev);
+
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -6061,7 +6244,12 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		}
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+
+		YWMB();
+		in->lazyLoaded = 0;
 	}
+
+	YREADER_UNLOCK(dev);
 }
 
 static int yaffs_ScanBackwards(yaffs_Device *dev)
@@ -6097,6 +6285,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
+	yaffs_ExtendedTags *blockTags = NULL;
+	int haveBlockTags;
 
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
@@ -6127,6 +6317,13 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	dev->blocksInCheckpoint = 0;
 
+	/* If the driver can read a whole block's tags at once, we use that
+	 * below. Not fatal if there is no memory for it.
+	 */
+	if (dev->readBlockTagsFromNAND)
+		blockTags = YMALLOC(dev->nChunksPerBlock *
+				    sizeof(yaffs_ExtendedTags));
+
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 	/* Scan all the blocks to determine their state */
@@ -6244,6 +6441,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		haveBlockTags = blockTags &&
+			(state == YAFFS_BLOCK_STATE_NEEDS_SCANNING ||
+			 state == YAFFS_BLOCK_STATE_ALLOCATING) &&
+			yaffs_ReadBlockTagsFromNAND(dev, blk, blockTags) == YAFFS_OK;
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6256,8 +6458,12 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (haveBlockTags) {
+				tags = blockTags[c];
+				result = YAFFS_OK;
+			} else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6396,7 +6602,10 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
 				    !in->valid ||
 #endif
-				    tags.extraShadows ||
+				    /* Shadowing is only handled for the newest
+				     * header, older ones have nothing more to give.
+				     */
+				    (tags.extraShadows && !in->valid) ||
 				    (!in->valid &&
 				    (tags.objectId == YAFFS_OBJECTID_ROOT ||
 				     tags.objectId == YAFFS_OBJECTID_LOSTNFOUND))) {
@@ -6605,6 +6814,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 						YINIT_LIST_HEAD(&parent->variant.
 							directoryVariant.
 							children);
+						parent->variant.directoryVariant.
+							hash = NULL;
 					} else if (!parent || parent->variantType !=
 						   YAFFS_OBJECT_TYPE_DIRECTORY) {
 						/* Hoosterman, another problem....
@@ -6711,6 +6922,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	else
 		YFREE(blockIndex);
 
+	if (blockTags)
+		YFREE(blockTags);
+
 	/* Ok, we've done all the scanning.
 	 * Fix up the hard link chains.
 	 * We should now have scanned all the objects, now it's time to add these
@@ -6828,6 +7042,147 @@ static void yaffs_UpdateParent(yaffs_Object *obj)
 	yaffs_UpdateObjectHeader(obj,NULL,0,0,0);
 }
 
+/*
+ * Directory name index.
+ *
+ * A lookup that has to walk more than YAFFS_DIR_HASH_MIN_CHILDREN children
+ * builds a hash of the directory keyed on the name sum. Add/Remove keep it
+ * up to date; when it gets too full it is dropped and the next lookup
+ * builds a bigger one.
+ *
+ * The index is only changed under the exclusive gross lock, except that a
+ * lookup may build it while holding the shared one, so building is
+ * serialised with YREADER_LOCK and the pointer is published last.
+ *
+ * Objects without a header are called objNNN whatever their sum is, so
+ * lookups of such names (and of lost+found) still walk the list.
+ */
+
+static int yaffs_DirHashBucket(yaffs_DirHash *hash, int sum)
+{
+	return (sum ^ (sum >> 7)) & (hash->nBuckets - 1);
+}
+
+static void yaffs_DirHashInsert(yaffs_DirHash *hash, yaffs_Object *obj)
+{
+	if (obj->lazyLoaded)
+		/* Name (and sum) not known yet */
+		ylist_add(&obj->dirHashLink, &hash->unhashed);
+	else
+		ylist_add(&obj->dirHashLink,
+			  &hash->buckets[yaffs_DirHashBucket(hash, obj->sum)]);
+	hash->nEntries++;
+}
+
+static void yaffs_DirHashRemove(yaffs_Object *obj)
+{
+	if (!ylist_empty(&obj->dirHashLink)) {
+		ylist_del_init(&obj->dirHashLink);
+		obj->parent->variant.directoryVariant.hash->nEntries--;
+	}
+}
+
+static void yaffs_DropDirHash(yaffs_Object *directory)
+{
+	yaffs_DirHash *hash = directory->variant.directoryVariant.hash;
+	struct ylist_head *i;
+
+	if (!hash)
+		return;
+
+	directory->variant.directoryVariant.hash = NULL;
+
+	ylist_for_each(i, &directory->variant.directoryVariant.children)
+		YINIT_LIST_HEAD(&ylist_entry(i, yaffs_Object, siblings)->
+				dirHashLink);
+
+	YFREE(hash);
+}
+
+static void yaffs_BuildDirHash(yaffs_Object *directory)
+{
+	yaffs_Device *dev = directory->myDev;
+	yaffs_DirHash *hash;
+	struct ylist_head *i;
+	int nChildren = 0;
+	int nBuckets = 16;
+
+	/* Load the names first, that takes the reader lock itself */
+	ylist_for_each(i, &directory->variant.directoryVariant.children) {
+		yaffs_CheckObjectDetailsLoaded(ylist_entry(i, yaffs_Object,
+							   siblings));
+		nChildren++;
+	}
+
+	while (nBuckets < nChildren / 2 &&
+	       nBuckets < YAFFS_DIR_HASH_MAX_BUCKETS)
+		nBuckets <<= 1;
+
+	hash = YMALLOC(sizeof(yaffs_DirHash) +
+		       (nBuckets - 1) * sizeof(struct ylist_head));
+	if (!hash)
+		return;		/* Not fatal, we just keep walking the list */
+
+	hash->nBuckets = nBuckets;
+	hash->nEntries = 0;
+	YINIT_LIST_HEAD(&hash->unhashed);
+	for (nBuckets = 0; nBuckets < hash->nBuckets; nBuckets++)
+		YINIT_LIST_HEAD(&hash->buckets[nBuckets]);
+
+	YREADER_LOCK(dev);
+	if (directory->variant.directoryVariant.hash) {
+		/* Somebody else beat us to it */
+		YREADER_UNLOCK(dev);
+		YFREE(hash);
+		return;
+	}
+
+	ylist_for_each(i, &directory->variant.directoryVariant.children)
+		yaffs_DirHashInsert(hash, ylist_entry(i, yaffs_Object,
+						      siblings));
+
+	YWMB();
+	directory->variant.directoryVariant.hash = hash;
+	YREADER_UNLOCK(dev);
+
+	T(YAFFS_TRACE_OS,
+	  (TSTR("yaffs: name index for directory %d, %d entries %d buckets"
+		TENDSTR), directory->objectId, hash->nEntries, hash->nBuckets));
+}
+
+static yaffs_Object *yaffs_FindInDirHash(yaffs_DirHash *hash,
+					 const YCHAR *name, int sum,
+					 YCHAR *buffer, int *nScanned)
+{
+	struct ylist_head *i;
+	yaffs_Object *l;
+
+	ylist_for_each(i, &hash->buckets[yaffs_DirHashBucket(hash, sum)]) {
+		l = ylist_entry(i, yaffs_Object, dirHashLink);
+		(*nScanned)++;
+		if (yaffs_SumCompare(l->sum, sum) && l->hdrChunk > 0) {
+			yaffs_GetObjectName(l, buffer,
+					    YAFFS_MAX_NAME_LENGTH + 1);
+			if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+				return l;
+		}
+	}
+
+	ylist_for_each(i, &hash->unhashed) {
+		l = ylist_entry(i, yaffs_Object, dirHashLink);
+		(*nScanned)++;
+		yaffs_CheckObjectDetailsLoaded(l);
+		if (yaffs_SumCompare(l->sum, sum) && l->hdrChunk > 0) {
+			yaffs_GetObjectName(l, buffer,
+					    YAFFS_MAX_NAME_LENGTH + 1);
+			if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+				return l;
+		}
+	}
+
+	return NULL;
+}
+
 static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
@@ -6842,6 +7197,7 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 		dev->removeObjectCallback(obj);
 
 
+	yaffs_DirHashRemove(obj);
 	ylist_del_init(&obj->siblings);
 	obj->parent = NULL;
 	
@@ -6882,6 +7238,16 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	ylist_add(&obj->siblings, &directory->variant.directoryVariant.children);
 	obj->parent = directory;
 
+	if (directory->variant.directoryVariant.hash) {
+		yaffs_DirHash *hash = directory->variant.directoryVariant.hash;
+
+		if (hash->nEntries >= 4 * hash->nBuckets &&
+		    hash->nBuckets < YAFFS_DIR_HASH_MAX_BUCKETS)
+			yaffs_DropDirHash(directory);
+		else
+			yaffs_DirHashInsert(hash, obj);
+	}
+
 	if (directory == obj->myDev->unlinkedDir
 			|| directory == obj->myDev->deletedDir) {
 		obj->unlinked = 1;
@@ -6902,6 +7268,10 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 
 	yaffs_Object *l;
+	yaffs_Object *found = NULL;
+	yaffs_DirHash *hash;
+	yaffs_Device *dev;
+	int nChildren = 0;
 
 	if (!name)
 		return NULL;
@@ -6920,8 +7290,24 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 		   ("tragedy: yaffs_FindObjectByName: non-directory" TENDSTR)));
 		YBUG();
 	}
+	dev = directory->myDev;
 
 	sum = yaffs_CalcNameSum(name);
+	dev->nNameLookups++;
+
+	if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) != 0 &&
+	    yaffs_strncmp(name, YAFFS_LOSTNFOUND_PREFIX,
+			  yaffs_strlen(YAFFS_LOSTNFOUND_PREFIX)) != 0) {
+		hash = directory->variant.directoryVariant.hash;
+		if (hash) {
+			YRMB();
+			dev->nHashedNameLookups++;
+			found = yaffs_FindInDirHash(hash, name, sum, buffer,
+						    &nChildren);
+			dev->nNameLookupScans += nChildren;
+			return found;
+		}
+	}
 
 	ylist_for_each(i, &directory->variant.directoryVariant.children) {
 		if (i) {
@@ -6931,6 +7317,7 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 				YBUG();
 
 			yaffs_CheckObjectDetailsLoaded(l);
+			nChildren++;
 
 			/* Special case for lost-n-found */
 			if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
@@ -6942,13 +7329,21 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 				 */
 				yaffs_GetObjectName(l, buffer,
 						    YAFFS_MAX_NAME_LENGTH + 1);
-				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
+				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0) {
+					found = l;
+					break;
+				}
 			}
 		}
 	}
 
-	return NULL;
+	dev->nNameLookupScans += nChildren;
+
+	if (nChildren >= YAFFS_DIR_HASH_MIN_CHILDREN &&
+	    !directory->variant.directoryVariant.hash)
+		yaffs_BuildDirHash(directory);
+
+	return found;
 }
 
 
@@ -7417,6 +7812,13 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
+	dev->backgroundGarbageCollections = 0;
+	dev->gcUs = 0;
+	dev->nNameLookups = 0;
+	dev->nHashedNameLookups = 0;
+	dev->nNameLookupScans = 0;
+	dev->gcMaxUs = 0;
+	dev->backgroundGcUs = 0;
 	dev->currentDirtyChecker = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
@@ -7437,6 +7839,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 	dev->srCache = NULL;
+	dev->srCacheBucket = NULL;
+	YINIT_LIST_HEAD(&dev->srCacheLru);
 	dev->gcCleanupList = NULL;
 
 
@@ -7444,11 +7848,19 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	    dev->nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
 
 		if (dev->nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+
+		dev->srCacheBuckets = 1;
+		while (dev->srCacheBuckets < dev->nShortOpCaches)
+			dev->srCacheBuckets <<= 1;
+
+		dev->srCacheBucket = YMALLOC(dev->srCacheBuckets *
+					     sizeof(struct ylist_head));
 		dev->srCache =  YMALLOC(srCacheBytes);
 
 		buf = (__u8 *) dev->srCache;
@@ -7456,19 +7868,32 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		if (dev->srCacheBucket) {
+			for (i = 0; i < dev->srCacheBuckets; i++)
+				YINIT_LIST_HEAD(&dev->srCacheBucket[i]);
+		} else
+			buf = NULL;
+
 		for (i = 0; i < dev->nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			ylist_add_tail(&dev->srCache[i].lruLink,
+				       &dev->srCacheLru);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
 
-		dev->srLastUse = 0;
+		/* Don't let read-ahead push its own chunks out */
+		if (dev->nReadAheadChunks > dev->nShortOpCaches / 2)
+			dev->nReadAheadChunks = dev->nShortOpCaches / 2;
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
+	dev->readAheadChunks = 0;
+	dev->readAheadHits = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
@@ -7588,6 +8013,11 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			dev->srCache = NULL;
 		}
 
+		if (dev->srCacheBucket) {
+			YFREE(dev->srCacheBucket);
+			dev->srCacheBucket = NULL;
+		}
+
 		YFREE(dev->gcCleanupList);
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
@@ -60,6 +60,10 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+/* Directories with this many children get a name index on lookup */
+#define YAFFS_DIR_HASH_MIN_CHILDREN	32
+#define YAFFS_DIR_HASH_MAX_BUCKETS	1024
+
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
@@ -88,7 +92,7 @@
 
 /* */
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -115,10 +119,12 @@
 typedef struct {
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
+	struct ylist_head hashLink;	/* in dev->srCacheBucket[], if in use */
+	struct ylist_head lruLink;	/* in dev->srCacheLru, oldest first */
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
+	int readAhead;		/* Loaded by read-ahead and not read yet */
 #ifdef CONFIG_YAFFS_YAFFS2
 	__u8 *data;
 #else
@@ -383,10 +389,22 @@ typedef struct {
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+	int nextReadChunk;	/* Chunk a sequential reader will want next */
 } yaffs_FileStructure;
 
+/* Name index of a large directory, keyed on the name sum.
+ * Built on the first lookup and dropped when it gets too full.
+ */
+typedef struct {
+	int nBuckets;			/* power of 2 */
+	int nEntries;			/* children in the index */
+	struct ylist_head unhashed;	/* children added before their name was loaded */
+	struct ylist_head buckets[1];
+} yaffs_DirHash;
+
 typedef struct {
 	struct ylist_head children;     /* list of child links */
+	yaffs_DirHash *hash;		/* name index, or NULL */
 } yaffs_DirectoryStructure;
 
 typedef struct {
@@ -438,6 +456,7 @@ struct yaffs_ObjectStruct {
 	/* also used for linking up the free list */
 	struct yaffs_ObjectStruct *parent;
 	struct ylist_head siblings;
+	struct ylist_head dirHashLink;	/* entry in the parent's name index */
 
 	/* Where's my object header in NAND? */
 	int hdrChunk;
@@ -589,6 +608,9 @@ struct yaffs_DeviceStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+	/* Optional: read the tags of every chunk in a block in one go */
+	int (*readBlockTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+				      int blockInNAND, yaffs_ExtendedTags *tags);
 #endif
 
 	int isYaffs2;
@@ -637,11 +659,23 @@ struct yaffs_DeviceStruct {
 #ifdef __KERNEL__
 
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
-	struct semaphore grossLock;	/* Gross locking semaphore */
+	struct rw_semaphore grossLock;	/* Gross lock, shared by readers */
+	struct mutex readerLock;	/* Readers' cache and lazy loading */
+	struct mutex nandLock;		/* Readers' NAND access */
+	spinlock_t tempLock;		/* Temp buffer allocation */
+	spinlock_t lockStatLock;	/* Gross lock wait statistics */
+	int grossLockWaits[2];		/* Exclusive, shared */
+	unsigned long long grossLockWaitUs[2];
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
+	struct task_struct *bgGcThread;	/* Background garbage collector */
+	wait_queue_head_t bgGcWait;	/* Background GC sleeps here */
+	int bgGcWake;			/* Writers want background GC */
+	int wasCheckpointed;		/* isCheckpointed at GrossLock */
+	unsigned long lastActivity;	/* jiffies of the last write op */
+	unsigned long lastBgCheckpoint;	/* jiffies of the last bg checkpoint */
 #endif
 
 	int isMounted;
@@ -722,6 +756,10 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
+	unsigned long long gcUs;	/* Time in GC from the write path */
+	unsigned gcMaxUs;
+	unsigned long long backgroundGcUs;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -746,9 +784,23 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head *srCacheBucket;
+	int srCacheBuckets;		/* power of 2 */
+	struct ylist_head srCacheLru;	/* empty chunks first, then LRU order */
+
+	int nReadAheadChunks;	/* Chunks to read ahead of a sequential reader */
 
 	int cacheHits;
+	int cacheMisses;
+
+	/* Name lookups, and directory entries they looked at. Updated
+	 * without a lock, so they can drop counts when readers race.
+	 */
+	int nNameLookups;
+	int nHashedNameLookups;
+	unsigned long long nNameLookupScans;
+	int readAheadChunks;
+	int readAheadHits;
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -820,6 +872,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev);
 void yaffs_Deinitialise(yaffs_Device *dev);
 
 int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev);
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int minErased,
+				   int maxLive);
 
 int yaffs_RenameObject(yaffs_Object *oldDir, const YCHAR *oldName,
 		       yaffs_Object *newDir, const YCHAR *newName);
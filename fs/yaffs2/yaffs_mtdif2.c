@@ -197,6 +197,74 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Read the tags of a whole block with a single multi-page OOB read, so the
+ * NAND driver can stream the spare areas instead of being asked for one
+ * page at a time. Only for tags kept in the OOB.
+ */
+int nandmtd2_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+				   yaffs_ExtendedTags *tags)
+{
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	struct mtd_oob_ops ops;
+	yaffs_PackedTags2 pt;
+	int packed_tags_size;
+	int oobavail;
+	int retval;
+	int i;
+	__u8 *buffer;
+
+	packed_tags_size = dev->doesTagsEcc ? sizeof(pt) : sizeof(pt.t);
+
+	if (dev->inbandTags || !mtd->ecclayout)
+		return YAFFS_FAIL;
+
+	oobavail = mtd->ecclayout->oobavail;
+	if (oobavail < packed_tags_size)
+		return YAFFS_FAIL;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadBlockTagsFromNAND block %d" TENDSTR),
+	   blockInNAND));
+
+	/* Slack at the end so the last memcpy can't run off the buffer */
+	buffer = YMALLOC(dev->nChunksPerBlock * oobavail + sizeof(pt));
+	if (!buffer)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = dev->nChunksPerBlock * oobavail;
+	ops.len = 0;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = buffer;
+	retval = mtd->read_oob(mtd, ((loff_t) blockInNAND) *
+				dev->nChunksPerBlock * dev->totalBytesPerChunk,
+			       &ops);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen) {
+		for (i = 0; i < dev->nChunksPerBlock; i++) {
+			memcpy(&pt, buffer + i * oobavail, sizeof(pt));
+			yaffs_UnpackTags2(dev, &tags[i], &pt);
+
+			if (tags[i].eccResult == YAFFS_ECC_RESULT_FIXED)
+				dev->tagsEccFixed++;
+			if (tags[i].eccResult == YAFFS_ECC_RESULT_UNFIXED)
+				dev->tagsEccUnfixed++;
+		}
+	}
+
+	YFREE(buffer);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+#else
+	return YAFFS_FAIL;
+#endif
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
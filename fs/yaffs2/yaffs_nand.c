@@ -29,6 +29,9 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 
 	int realignedChunkInNAND = chunkInNAND - dev->chunkOffset;
 
+	/* Readers share the spare buffer, statistics and block info */
+	YNAND_LOCK(dev);
+
 	dev->nPageReads++;
 
 	/* If there are no tags provided, use local tags to get prioritised gc working */
@@ -50,6 +53,8 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		yaffs_HandleChunkError(dev, bi);
 	}
 
+	YNAND_UNLOCK(dev);
+
 	return result;
 }
 
@@ -117,6 +122,40 @@ int yaffs_QueryInitialBlockState(yaffs_Device *dev,
 }
 
 
+/* Read the tags of all the chunks in a block, if the driver can do that
+ * in one go. Returns YAFFS_FAIL if it can't, and the caller should read
+ * the chunks one by one.
+ */
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockNo,
+					yaffs_ExtendedTags *tags)
+{
+	int result;
+	int i;
+
+	if (!dev->readBlockTagsFromNAND)
+		return YAFFS_FAIL;
+
+	YNAND_LOCK(dev);
+
+	result = dev->readBlockTagsFromNAND(dev, blockNo - dev->blockOffset,
+					    tags);
+	if (result == YAFFS_OK) {
+		dev->nPageReads += dev->nChunksPerBlock;
+
+		for (i = 0; i < dev->nChunksPerBlock; i++) {
+			if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR) {
+				yaffs_HandleChunkError(dev,
+					yaffs_GetBlockInfo(dev, blockNo));
+				break;
+			}
+		}
+	}
+
+	YNAND_UNLOCK(dev);
+
+	return result;
+}
+
 int yaffs_EraseBlockInNAND(struct yaffs_DeviceStruct *dev,
 				  int blockInNAND)
 {
@@ -35,6 +35,9 @@ int yaffs_QueryInitialBlockState(yaffs_Device *dev,
 						yaffs_BlockState *state,
 						unsigned *sequenceNumber);
 
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockNo,
+					yaffs_ExtendedTags *tags);
+
 int yaffs_EraseBlockInNAND(struct yaffs_DeviceStruct *dev,
 				  int blockInNAND);
 
@@ -43,7 +43,10 @@
 #endif
 #include <linux/kernel.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
@@ -74,12 +77,26 @@
 /* KR - added for use in scan so processes aren't blocked indefinitely. */
 #define YYIELD() schedule()
 
+/* Read paths may run concurrently while the gross lock is held shared.
+ * These serialize the shared state they touch, always taken in the order
+ * reader lock -> nand lock -> temp lock.
+ */
+#define YREADER_LOCK(dev)   mutex_lock(&(dev)->readerLock)
+#define YREADER_UNLOCK(dev) mutex_unlock(&(dev)->readerLock)
+#define YNAND_LOCK(dev)     mutex_lock(&(dev)->nandLock)
+#define YNAND_UNLOCK(dev)   mutex_unlock(&(dev)->nandLock)
+#define YTEMP_LOCK(dev)     spin_lock(&(dev)->tempLock)
+#define YTEMP_UNLOCK(dev)   spin_unlock(&(dev)->tempLock)
+#define YWMB() smp_wmb()
+#define YRMB() smp_rmb()
+
 #define YAFFS_ROOT_MODE			0666
 #define YAFFS_LOSTNFOUND_MODE		0666
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 #define Y_CURRENT_TIME CURRENT_TIME.tv_sec
 #define Y_TIME_CONVERT(x) (x).tv_sec
+#define Y_CLOCK_US() ktime_to_us(ktime_get())
 #else
 #define Y_CURRENT_TIME CURRENT_TIME
 #define Y_TIME_CONVERT(x) (x)
@@ -194,6 +211,23 @@ extern unsigned int yaffs_wr_attempts;
 #define YAFFS_TRACE_ALWAYS		0xF0000000
 
 
+/* Environments without concurrent readers need no locking */
+#ifndef YREADER_LOCK
+#define YREADER_LOCK(dev)   do {} while (0)
+#define YREADER_UNLOCK(dev) do {} while (0)
+#define YNAND_LOCK(dev)     do {} while (0)
+#define YNAND_UNLOCK(dev)   do {} while (0)
+#define YTEMP_LOCK(dev)     do {} while (0)
+#define YTEMP_UNLOCK(dev)   do {} while (0)
+#define YWMB() do {} while (0)
+#define YRMB() do {} while (0)
+#endif
+
+/* Only used for statistics, so environments without a clock read 0 */
+#ifndef Y_CLOCK_US
+#define Y_CLOCK_US() 0
+#endif
+
 #define T(mask, p) do { if ((mask) & (yaffs_traceMask | YAFFS_TRACE_ALWAYS)) TOUT(p); } while (0)
 
 #ifndef YBUG
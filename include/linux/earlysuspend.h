@@ -18,6 +18,8 @@
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 #endif
 
 /* The early_suspend structure defines suspend and resume hooks to be called
@@ -25,10 +27,14 @@
  * control the order. They can be used to turn off the screen and input
  * devices that are not used for wakeup.
  * Suspend handlers are called in low to high level order, resume handlers are
- * called in the opposite order. If, when calling register_early_suspend,
- * the suspend handlers have already been called without a matching call to the
- * resume handlers, the suspend handler will be called directly from
- * register_early_suspend. This direct call can violate the normal level order.
+ * called in the opposite order. Within a level they are called one at a time,
+ * in registration order, unless they set parallel: consecutive parallel
+ * handlers of the same level are called concurrently, and so must not depend
+ * on each other. If, when calling
+ * register_early_suspend, the suspend handlers have already been called
+ * without a matching call to the resume handlers, the suspend handler will be
+ * called directly from register_early_suspend. This direct call can violate
+ * the normal level order.
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
@@ -41,6 +47,13 @@ struct early_suspend {
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	int parallel;	/* may run alongside other handlers of its level */
+	/* internal: runs the hook, and timing of the last and slowest calls */
+	struct work_struct work;
+	ktime_t suspend_time;
+	ktime_t max_suspend_time;
+	ktime_t resume_time;
+	ktime_t max_resume_time;
 #endif
 };
 
@@ -379,6 +379,18 @@ struct dev_pm_info {
  * or from system low-power states such as standby or suspend-to-RAM.
  */
 
+/*
+ * Points of a suspend/resume cycle timed by the device PM profiler, from
+ * the outermost (wakelock suspend work) to the innermost (device_suspend()
+ * to device_resume()).
+ */
+enum dpm_profile_point {
+	DPM_POINT_WAKELOCK_SUSPEND,
+	DPM_POINT_PM_SUSPEND,
+	DPM_POINT_DEVICES,
+	DPM_NR_POINTS,
+};
+
 #ifdef CONFIG_PM_SLEEP
 extern void device_pm_lock(void);
 extern int sysdev_resume(void);
@@ -390,6 +402,9 @@ extern int sysdev_suspend(pm_message_t state);
 extern int device_power_down(pm_message_t state);
 extern int device_suspend(pm_message_t state);
 extern int device_prepare_suspend(pm_message_t state);
+extern void device_pm_profile_platform(u64 enter_ns, u64 exit_ns);
+extern void device_pm_profile_enter(enum dpm_profile_point point);
+extern void device_pm_profile_exit(enum dpm_profile_point point);
 
 extern void __suspend_report_result(const char *function, void *fn, int ret);
 
@@ -405,6 +420,10 @@ static inline int device_suspend(pm_message_t state)
 	return 0;
 }
 
+static inline void device_pm_profile_platform(u64 enter_ns, u64 exit_ns) {}
+static inline void device_pm_profile_enter(enum dpm_profile_point point) {}
+static inline void device_pm_profile_exit(enum dpm_profile_point point) {}
+
 #define suspend_report_result(fn, ret)		do {} while (0)
 
 #endif /* !CONFIG_PM_SLEEP */
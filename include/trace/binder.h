@@ -0,0 +1,28 @@
+#ifndef _TRACE_BINDER_H
+#define _TRACE_BINDER_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+DECLARE_TRACE(binder_transaction,
+	TPPROTO(int debug_id, int reply, unsigned int flags, int to_proc,
+		int to_thread, size_t data_size),
+		TPARGS(debug_id, reply, flags, to_proc, to_thread, data_size));
+
+DECLARE_TRACE(binder_transaction_received,
+	TPPROTO(int debug_id, int proc, int thread, u64 queue_ns),
+		TPARGS(debug_id, proc, thread, queue_ns));
+
+DECLARE_TRACE(binder_reply,
+	TPPROTO(int debug_id, int in_reply_to, u64 service_ns),
+		TPARGS(debug_id, in_reply_to, service_ns));
+
+DECLARE_TRACE(binder_buffer_alloc,
+	TPPROTO(int proc, size_t size, int is_async),
+		TPARGS(proc, size, is_async));
+
+DECLARE_TRACE(binder_buffer_free,
+	TPPROTO(int proc, size_t size),
+		TPARGS(proc, size));
+
+#endif
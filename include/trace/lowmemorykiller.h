@@ -0,0 +1,16 @@
+#ifndef _TRACE_LOWMEMORYKILLER_H
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+DECLARE_TRACE(lowmem_kill,
+	TPPROTO(struct task_struct *p, int tasksize, int min_adj,
+		int other_free, int other_file),
+		TPARGS(p, tasksize, min_adj, other_free, other_file));
+
+DECLARE_TRACE(lowmem_reaped,
+	TPPROTO(pid_t pid, u64 reap_ns, int timed_out),
+		TPARGS(pid, reap_ns, timed_out));
+
+#endif
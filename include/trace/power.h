@@ -0,0 +1,23 @@
+#ifndef _TRACE_POWER_H
+#define _TRACE_POWER_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+DECLARE_TRACE(dpm_callback,
+	TPPROTO(struct device *dev, int phase, u64 ns, int error),
+		TPARGS(dev, phase, ns, error));
+
+DECLARE_TRACE(dpm_platform,
+	TPPROTO(u64 enter_ns, u64 exit_ns),
+		TPARGS(enter_ns, exit_ns));
+
+DECLARE_TRACE(dpm_point,
+	TPPROTO(int point, int exit),
+		TPARGS(point, exit));
+
+DECLARE_TRACE(dpm_cycle,
+	TPPROTO(u64 total_ns, unsigned int nr_callbacks),
+		TPARGS(total_ns, nr_callbacks));
+
+#endif
@@ -13,10 +13,13 @@
  *
  */
 
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -44,10 +47,78 @@ enum {
 };
 static int state;
 
+/* Runs the hooks of parallel handlers sharing a level concurrently */
+static struct workqueue_struct *early_suspend_wq;
+static int handlers_resuming;
+static ktime_t early_suspend_time;
+static ktime_t late_resume_time;
+
+static void call_handler(struct early_suspend *h, int resume)
+{
+	ktime_t start, delta;
+
+	start = ktime_get();
+	if (resume)
+		h->resume(h);
+	else
+		h->suspend(h);
+	delta = ktime_sub(ktime_get(), start);
+
+	if (resume) {
+		h->resume_time = delta;
+		if (delta.tv64 > h->max_resume_time.tv64)
+			h->max_resume_time = delta;
+	} else {
+		h->suspend_time = delta;
+		if (delta.tv64 > h->max_suspend_time.tv64)
+			h->max_suspend_time = delta;
+	}
+	if (debug_mask & DEBUG_SUSPEND)
+		pr_info("%s: %pF took %lld us\n",
+			resume ? "late_resume" : "early_suspend",
+			resume ? (void *)h->resume : (void *)h->suspend,
+			ktime_to_us(delta));
+}
+
+static void early_suspend_handler_work(struct work_struct *work)
+{
+	struct early_suspend *h = container_of(work, struct early_suspend,
+					       work);
+	call_handler(h, handlers_resuming);
+}
+
+/*
+ * Run the hook of handler h. Parallel handlers are queued, spread over the
+ * online cpus, and only waited for when a handler of another level or a
+ * serial one comes up; serial handlers are called directly.
+ * Caller must hold early_suspend_lock.
+ */
+static void dispatch_handler(struct early_suspend *h, int *level,
+			     int *pending, int *cpu)
+{
+	if (*pending && (h->level != *level || !h->parallel)) {
+		flush_workqueue(early_suspend_wq);
+		*pending = 0;
+	}
+	*level = h->level;
+
+	if (!h->parallel || !early_suspend_wq) {
+		call_handler(h, handlers_resuming);
+		return;
+	}
+
+	*cpu = cpumask_next(*cpu, cpu_online_mask);
+	if (*cpu >= nr_cpu_ids)
+		*cpu = cpumask_first(cpu_online_mask);
+	queue_work_on(*cpu, early_suspend_wq, &h->work);
+	*pending = 1;
+}
+
 void register_early_suspend(struct early_suspend *handler)
 {
 	struct list_head *pos;
 
+	INIT_WORK(&handler->work, early_suspend_handler_work);
 	mutex_lock(&early_suspend_lock);
 	list_for_each(pos, &early_suspend_handlers) {
 		struct early_suspend *e;
@@ -75,6 +146,8 @@ static void early_suspend(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	int level = 0, pending = 0, cpu = -1;
+	ktime_t start;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -93,10 +166,15 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
+	start = ktime_get();
+	handlers_resuming = 0;
 	list_for_each_entry(pos, &early_suspend_handlers, link) {
 		if (pos->suspend != NULL)
-			pos->suspend(pos);
+			dispatch_handler(pos, &level, &pending, &cpu);
 	}
+	if (pending)
+		flush_workqueue(early_suspend_wq);
+	early_suspend_time = ktime_sub(ktime_get(), start);
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -115,6 +193,8 @@ static void late_resume(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	int level = 0, pending = 0, cpu = -1;
+	ktime_t start;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -131,9 +211,14 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
+	start = ktime_get();
+	handlers_resuming = 1;
 	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
 		if (pos->resume != NULL)
-			pos->resume(pos);
+			dispatch_handler(pos, &level, &pending, &cpu);
+	if (pending)
+		flush_workqueue(early_suspend_wq);
+	late_resume_time = ktime_sub(ktime_get(), start);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -176,3 +261,54 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int early_suspend_stats_show(struct seq_file *m, void *unused)
+{
+	struct early_suspend *pos;
+
+	mutex_lock(&early_suspend_lock);
+	seq_printf(m, "early_suspend\t%lld us\nlate_resume\t%lld us\n\n",
+		   ktime_to_us(early_suspend_time),
+		   ktime_to_us(late_resume_time));
+	seq_printf(m, "level\tsuspend_us\tmax_us\tresume_us\tmax_us"
+		   "\thandler\n");
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		seq_printf(m, "%d\t%lld\t%lld\t%lld\t%lld\t%pF\n",
+			   pos->level, ktime_to_us(pos->suspend_time),
+			   ktime_to_us(pos->max_suspend_time),
+			   ktime_to_us(pos->resume_time),
+			   ktime_to_us(pos->max_resume_time),
+			   pos->suspend ? (void *)pos->suspend :
+					  (void *)pos->resume);
+	mutex_unlock(&early_suspend_lock);
+	return 0;
+}
+
+static int early_suspend_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_stats_show, NULL);
+}
+
+static const struct file_operations early_suspend_stats_fops = {
+	.open = early_suspend_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+static int __init early_suspend_init(void)
+{
+	/* Without the workqueue, handlers are simply called one by one */
+	early_suspend_wq = create_workqueue("early_suspend");
+	if (!early_suspend_wq)
+		pr_err("early_suspend_init: create_workqueue failed\n");
+
+#ifdef CONFIG_DEBUG_FS
+	debugfs_create_file("early_suspend", S_IRUGO, NULL, NULL,
+			    &early_suspend_stats_fops);
+#endif
+	return 0;
+}
+late_initcall(early_suspend_init);
@@ -464,9 +464,15 @@ static int enter_state(suspend_state_t state)
 
 int pm_suspend(suspend_state_t state)
 {
-	if (state > PM_SUSPEND_ON && state <= PM_SUSPEND_MAX)
-		return enter_state(state);
-	return -EINVAL;
+	int error;
+
+	if (state <= PM_SUSPEND_ON || state > PM_SUSPEND_MAX)
+		return -EINVAL;
+
+	device_pm_profile_enter(DPM_POINT_PM_SUSPEND);
+	error = enter_state(state);
+	device_pm_profile_exit(DPM_POINT_PM_SUSPEND);
+	return error;
 }
 
 EXPORT_SYMBOL(pm_suspend);
@@ -45,6 +45,13 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/*
+ * Active locks are also indexed so that has_wake_lock need not walk them:
+ * locks with a timeout sit in a tree ordered by expiry, the others are
+ * only counted.
+ */
+static struct rb_root expire_tree[WAKE_LOCK_TYPE_COUNT];
+static int active_no_timeout[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -156,7 +163,80 @@ static int wakelocks_read_proc(char *page, char **start, off_t off,
 	return len;
 }
 
-static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
+/*
+ * Cost of wake_lock and wake_unlock, measured from entry until list_lock is
+ * dropped, so that it includes waiting for the lock. Kept per cpu so the
+ * accounting itself stays out from under list_lock.
+ */
+enum {
+	WAKE_LOCK_COST_LOCK,
+	WAKE_LOCK_COST_UNLOCK,
+	WAKE_LOCK_COST_COUNT
+};
+
+struct wake_lock_cost {
+	unsigned long count;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+static DEFINE_PER_CPU(struct wake_lock_cost,
+		      wake_lock_cost[WAKE_LOCK_COST_COUNT]);
+static int registered_locks;
+
+static void wake_lock_cost_add(int op, ktime_t start)
+{
+	struct wake_lock_cost *cost;
+	unsigned long irqflags;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	local_irq_save(irqflags);
+	cost = &__get_cpu_var(wake_lock_cost)[op];
+	cost->count++;
+	cost->total_ns += ns;
+	if (ns > cost->max_ns)
+		cost->max_ns = ns;
+	local_irq_restore(irqflags);
+}
+
+static int wake_lock_cost_read_proc(char *page, char **start, off_t off,
+				    int count, int *eof, void *data)
+{
+	static const char *op_names[WAKE_LOCK_COST_COUNT] = {
+		"wake_lock", "wake_unlock"
+	};
+	int len;
+	int op;
+	int cpu;
+
+	len = snprintf(page, count, "registered_locks\t%d\n"
+		       "op\tcount\ttotal_ns\tmax_ns\n", registered_locks);
+	for (op = 0; op < WAKE_LOCK_COST_COUNT; op++) {
+		unsigned long calls = 0;
+		u64 total_ns = 0;
+		u64 max_ns = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct wake_lock_cost *cost =
+				&per_cpu(wake_lock_cost, cpu)[op];
+			calls += cost->count;
+			total_ns += cost->total_ns;
+			if (cost->max_ns > max_ns)
+				max_ns = cost->max_ns;
+		}
+		len += snprintf(page + len, count - len, "%s\t%lu\t%llu\t%llu\n",
+				op_names[op], calls,
+				(unsigned long long)total_ns,
+				(unsigned long long)max_ns);
+	}
+	*eof = 1;
+
+	return len > count ? count : len;
+}
+
+/* Callers read the clock before taking list_lock and pass it as time */
+static void wake_unlock_stat_locked(struct wake_lock *lock, int expired,
+				    ktime_t time)
 {
 	ktime_t duration;
 	ktime_t now;
@@ -165,7 +245,7 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	if (get_expired_time(lock, &now))
 		expired = 1;
 	else
-		now = ktime_get();
+		now = time;
 	lock->stat.count++;
 	if (expired)
 		lock->stat.expire_count++;
@@ -173,7 +253,7 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
-	lock->stat.last_time = ktime_get();
+	lock->stat.last_time = time;
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
 		duration = ktime_sub(now, last_sleep_time_update);
 		lock->stat.prevent_suspend_time = ktime_add(
@@ -182,13 +262,12 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	}
 }
 
-static void update_sleep_wait_stats_locked(int done)
+static void update_sleep_wait_stats_locked(int done, ktime_t now)
 {
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
+	ktime_t etime, elapsed, add;
 	int expired;
 
-	now = ktime_get();
 	elapsed = ktime_sub(now, last_sleep_time_update);
 	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
 		expired = get_expired_time(lock, &etime);
@@ -210,11 +289,48 @@ static void update_sleep_wait_stats_locked(int done)
 #endif
 
 
+/* Caller must acquire the list_lock spinlock */
+static void expire_tree_insert(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &expire_tree[type].rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, expire_node);
+		if (time_before(lock->expires, entry->expires))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &expire_tree[type]);
+}
+
+/*
+ * Drop an active lock from the expiry tree or the count of locks without
+ * timeout. Must be called before its flags change.
+ * Caller must acquire the list_lock spinlock.
+ */
+static void wake_lock_dequeue(struct wake_lock *lock)
+{
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->expire_node, &expire_tree[type]);
+	else
+		active_no_timeout[type]--;
+}
+
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 1);
+	wake_unlock_stat_locked(lock, 1, ktime_get());
 #endif
+	wake_lock_dequeue(lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -244,21 +360,23 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock *lock;
+	struct rb_node *node;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	while ((node = rb_first(&expire_tree[type]))) {
+		lock = rb_entry(node, struct wake_lock, expire_node);
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	if (active_no_timeout[type])
+		return -1;
+	node = rb_last(&expire_tree[type]);
+	if (!node)
+		return 0;
+	lock = rb_entry(node, struct wake_lock, expire_node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
@@ -282,6 +400,7 @@ static void suspend(struct work_struct *work)
 		return;
 	}
 
+	device_pm_profile_enter(DPM_POINT_WAKELOCK_SUSPEND);
 	entry_event_num = current_event_num;
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
@@ -302,6 +421,7 @@ static void suspend(struct work_struct *work)
 			pr_info("suspend: pm_suspend returned with no event\n");
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
 	}
+	device_pm_profile_exit(DPM_POINT_WAKELOCK_SUSPEND);
 }
 static DECLARE_WORK(suspend_work, suspend);
 
@@ -366,6 +486,9 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	INIT_LIST_HEAD(&lock->link);
 	spin_lock_irqsave(&list_lock, irqflags);
 	list_add(&lock->link, &inactive_locks);
+#ifdef CONFIG_WAKELOCK_STAT
+	registered_locks++;
+#endif
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
@@ -376,6 +499,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
+	wake_lock_dequeue(lock);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
@@ -391,6 +515,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 			ktime_add(deleted_wake_locks.stat.max_time,
 				  lock->stat.max_time);
 	}
+	registered_locks--;
 #endif
 	list_del(&lock->link);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -403,6 +528,9 @@ static void wake_lock_internal(
 	int type;
 	unsigned long irqflags;
 	long expire_in;
+#ifdef CONFIG_WAKELOCK_STAT
+	ktime_t now = ktime_get();
+#endif
 
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
@@ -417,14 +545,15 @@ static void wake_lock_internal(
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
 	    (long)(lock->expires - jiffies) <= 0) {
-		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
+		wake_unlock_stat_locked(lock, 0, now);
+		lock->stat.last_time = now;
 	}
 #endif
+	wake_lock_dequeue(lock);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+		lock->stat.last_time = now;
 #endif
 	}
 	list_del(&lock->link);
@@ -436,20 +565,22 @@ static void wake_lock_internal(
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
 		list_add_tail(&lock->link, &active_wake_locks[type]);
+		expire_tree_insert(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
+		active_no_timeout[type]++;
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
+			update_sleep_wait_stats_locked(1, now);
 		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats_locked(0, now);
 #endif
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
@@ -470,6 +601,9 @@ static void wake_lock_internal(
 		}
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	wake_lock_cost_add(WAKE_LOCK_COST_LOCK, now);
+#endif
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -488,13 +622,17 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
+#ifdef CONFIG_WAKELOCK_STAT
+	ktime_t now = ktime_get();
+#endif
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
+	wake_unlock_stat_locked(lock, 0, now);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	wake_lock_dequeue(lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -517,11 +655,14 @@ void wake_unlock(struct wake_lock *lock)
 			if (debug_mask & DEBUG_SUSPEND)
 				print_active_locks(WAKE_LOCK_SUSPEND);
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats_locked(0, now);
 #endif
 		}
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	wake_lock_cost_add(WAKE_LOCK_COST_UNLOCK, now);
+#endif
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -536,8 +677,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		expire_tree[i] = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -567,6 +710,8 @@ static int __init wakelocks_init(void)
 #ifdef CONFIG_WAKELOCK_STAT
 	create_proc_read_entry("wakelocks", S_IRUGO, NULL,
 				wakelocks_read_proc, NULL);
+	create_proc_read_entry("wakelock_cost", S_IRUGO, NULL,
+				wake_lock_cost_read_proc, NULL);
 #endif
 
 	return 0;
@@ -587,6 +732,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	remove_proc_entry("wakelock_cost", NULL);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
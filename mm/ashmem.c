@@ -26,7 +26,11 @@
 #include <linux/uaccess.h>
 #include <linux/personality.h>
 #include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
 #include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -37,7 +41,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +50,14 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	unsigned long purged_pages;	/* pages purged by the shrinker */
+	struct mutex mutex;		/* protects all of the above */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; 'lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,18 +68,37 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages and ranges on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
+static unsigned long lru_ranges;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and its counts
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> i_mutex -> i_alloc_sem
+ *                asma->mutex -> ashmem_lru_lock
+ *
+ * The shrinker walks the LRU under ashmem_lru_lock and so can only trylock
+ * an area's mutex; busy areas are rotated to the tail and skipped.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/*
+ * Contention counters, shown in debugfs/ashmem: pin ioctls that found their
+ * area busy and how long they waited for it, areas the shrinker had to skip
+ * and the pages it purged.  Protected by ashmem_lru_lock, which the pin path
+ * only takes when it had to wait.
+ */
+static struct ashmem_stats {
+	unsigned int pin_waits;
+	u64 pin_wait_ns;
+	u64 pin_wait_max_ns;
+	unsigned int shrink_busy;
+	unsigned long shrink_purged;
+} ashmem_stats;
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -104,14 +129,20 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	lru_ranges++;
+	spin_unlock(&ashmem_lru_lock);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_del(&range->lru);
 	lru_count -= range_size(range);
+	lru_ranges--;
+	spin_unlock(&ashmem_lru_lock);
 }
 
 /*
@@ -122,16 +153,17 @@ static inline void lru_del(struct ashmem_range *range)
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
+ * 'gfp' - allocation flags
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
-		       size_t start, size_t end)
+		       size_t start, size_t end, gfp_t gfp)
 {
 	struct ashmem_range *range;
 
-	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
+	range = kmem_cache_zalloc(ashmem_range_cachep, gfp);
 	if (unlikely(!range))
 		return -ENOMEM;
 
@@ -159,7 +191,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold range->asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +201,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -187,6 +222,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +235,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -216,7 +252,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -257,10 +293,44 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * ashmem_purge - purges up to 'nr_to_scan' pages from the tail of 'range',
+ * returning the number of pages purged. If the range is larger than that we
+ * split off and purge just its tail, unless we can't allocate the new range,
+ * in which case the whole range goes.
+ *
+ * Caller must hold range->asma->mutex.
+ */
+static size_t ashmem_purge(struct ashmem_range *range, long nr_to_scan)
+{
+	struct ashmem_area *asma = range->asma;
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	size_t start = range->pgstart;
+	size_t nr = range_size(range);
+
+	if (nr > nr_to_scan &&
+	    !range_alloc(asma, range, ASHMEM_WAS_PURGED,
+			 range->pgend - nr_to_scan + 1, range->pgend,
+			 GFP_NOWAIT | __GFP_NOWARN)) {
+		nr = nr_to_scan;
+		start = range->pgend - nr + 1;
+		range_shrink(range, range->pgstart, start - 1);
+	} else {
+		lru_del(range);
+		range->purged = ASHMEM_WAS_PURGED;
+	}
+
+	vmtruncate_range(inode, start * PAGE_SIZE,
+			 (start + nr) * PAGE_SIZE - 1);
+	asma->purged_pages += nr;
+
+	return nr;
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -274,11 +344,15 @@ out:
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * pages freed. Only the oldest range's tail is purged if that is enough.
  */
 static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	unsigned long budget;
+	int nr;
+	int ret;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
@@ -286,23 +360,33 @@ static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	if (!nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+	budget = lru_ranges;
+	while (nr_to_scan > 0 && budget-- && !list_empty(&ashmem_lru_list)) {
+		range = list_first_entry(&ashmem_lru_list, struct ashmem_range,
+					 lru);
+		asma = range->asma;
+
+		/* someone is busy with this area; leave it for now */
+		if (!mutex_trylock(&asma->mutex)) {
+			list_move_tail(&range->lru, &ashmem_lru_list);
+			ashmem_stats.shrink_busy++;
+			continue;
+		}
+		spin_unlock(&ashmem_lru_lock);
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		/* holding asma->mutex keeps the range on the LRU */
+		nr = ashmem_purge(range, nr_to_scan);
+		nr_to_scan -= nr;
+		mutex_unlock(&asma->mutex);
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+		spin_lock(&ashmem_lru_lock);
+		ashmem_stats.shrink_purged += nr;
 	}
-	mutex_unlock(&ashmem_mutex);
+	ret = lru_count;
+	spin_unlock(&ashmem_lru_lock);
 
-	return lru_count;
+	return ret;
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -314,7 +398,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -329,7 +413,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -337,7 +421,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -351,7 +435,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -360,7 +444,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -377,7 +461,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -386,7 +470,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -440,7 +524,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * second half and adjust the first chunk's endpoint.
 			 */
 			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+				    pgend + 1, range->pgend, GFP_KERNEL);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
 		}
@@ -452,7 +536,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -480,14 +564,14 @@ restart:
 		}
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, range, purged, pgstart, pgend, GFP_KERNEL);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -536,7 +620,19 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	if (!mutex_trylock(&asma->mutex)) {
+		u64 start = ktime_to_ns(ktime_get());
+		u64 wait_ns;
+
+		mutex_lock(&asma->mutex);
+		wait_ns = ktime_to_ns(ktime_get()) - start;
+		spin_lock(&ashmem_lru_lock);
+		ashmem_stats.pin_waits++;
+		ashmem_stats.pin_wait_ns += wait_ns;
+		if (wait_ns > ashmem_stats.pin_wait_max_ns)
+			ashmem_stats.pin_wait_max_ns = wait_ns;
+		spin_unlock(&ashmem_lru_lock);
+	}
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -550,7 +646,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -588,6 +684,11 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_GET_PURGED_PAGES:
+		mutex_lock(&asma->mutex);
+		ret = asma->purged_pages;
+		mutex_unlock(&asma->mutex);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
@@ -615,6 +716,38 @@ static struct miscdevice ashmem_misc = {
 	.fops = &ashmem_fops,
 };
 
+static int ashmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct ashmem_stats stats;
+
+	spin_lock(&ashmem_lru_lock);
+	stats = ashmem_stats;
+	spin_unlock(&ashmem_lru_lock);
+
+	seq_printf(m, "pin_waits: %u\n", stats.pin_waits);
+	seq_printf(m, "pin_wait_ns: %llu\n",
+		   (unsigned long long)stats.pin_wait_ns);
+	seq_printf(m, "pin_wait_max_ns: %llu\n",
+		   (unsigned long long)stats.pin_wait_max_ns);
+	seq_printf(m, "shrink_busy: %u\n", stats.shrink_busy);
+	seq_printf(m, "shrink_purged: %lu\n", stats.shrink_purged);
+	return 0;
+}
+
+static int ashmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ashmem_stats_show, NULL);
+}
+
+static const struct file_operations ashmem_stats_fops = {
+	.open = ashmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *ashmem_debugfs;
+
 static int __init ashmem_init(void)
 {
 	int ret;
@@ -642,6 +775,8 @@ static int __init ashmem_init(void)
 	}
 
 	register_shrinker(&ashmem_shrinker);
+	ashmem_debugfs = debugfs_create_file("ashmem", S_IRUGO, NULL, NULL,
+					     &ashmem_stats_fops);
 
 	printk(KERN_INFO "ashmem: initialized\n");
 
@@ -652,6 +787,7 @@ static void __exit ashmem_exit(void)
 {
 	int ret;
 
+	debugfs_remove(ashmem_debugfs);
 	unregister_shrinker(&ashmem_shrinker);
 
 	ret = misc_deregister(&ashmem_misc);